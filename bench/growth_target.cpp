@@ -0,0 +1,75 @@
+// GOGC-style pacing: a steady set of live objects plus a stream of
+// short-lived two-node cycles that only a pressure callback breaks.
+// Compares set_growth_target(100) with breaking the cycles by hand every
+// kManualEvery pairs, reporting collections, peak heap_usage() and time.
+
+#include "../gc/gc.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+struct Node {
+    char bytes[64];
+    GC::Ptr<Node> next;
+};
+
+static const int kLive = 50000;
+static const int kPairs = 2200000;
+static const int kManualEvery = 100000;
+
+static std::vector<GC::Ptr<Node>> garbage;
+static bool paced = false;
+static int collections = 0;
+
+static void break_cycles() {
+    for (auto& n : garbage) {
+        n->next.reset();
+    }
+    garbage.clear();
+}
+
+static void run(const char* name, bool pacing) {
+    paced = pacing;
+    collections = 0;
+    GC::set_growth_target(pacing ? 100 : -1);
+    size_t peak = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<GC::Ptr<Node>> live;
+        live.reserve(kLive);
+        for (int i = 0; i < kLive; ++i) {
+            live.push_back(GC::New<Node>());
+        }
+        for (int i = 0; i < kPairs; ++i) {
+            GC::Ptr<Node> a = GC::New<Node>();
+            GC::Ptr<Node> b = GC::New<Node>();
+            a->next = b;
+            b->next = a;
+            garbage.push_back(a);
+            if (!pacing && (i + 1) % kManualEvery == 0) {
+                break_cycles();
+                ++collections;
+            }
+            if ((i & 1023) == 0) {
+                peak = std::max(peak, GC::heap_usage());
+            }
+        }
+        break_cycles();
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%-20s %3d collections, peak %5.1f MB, %6.0f ms\n",
+        name, collections, peak / (1024.0 * 1024.0), ms);
+    GC::trim();
+}
+
+int main() {
+    GC::on_memory_pressure([](GC::Pressure) {
+        if (paced) {
+            break_cycles();
+            ++collections;
+        }
+    });
+    run("growth target 100:", true);
+    run("by hand:", false);
+    return 0;
+}
@@ -0,0 +1,110 @@
+
+// RSS of the GC heap as 200k objects are freed, trimmed or left to decay
+// (Linux: reads /proc/self/statm).
+// Numbers depend on the kernel (MADV_FREE pages stay in RSS until there is
+// memory pressure), so only compare runs on one machine.
+
+#include "../gc/gc.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Obj {
+    char bytes[100];
+    int value;
+
+    explicit Obj(int v = 0) : value(v) {}
+};
+
+static const int kObjects = 200000;
+
+static double rss_mb() {
+    std::ifstream f("/proc/self/statm");
+    long size = 0, resident = 0;
+    f >> size >> resident;
+    return resident * 4096.0 / (1024 * 1024);
+}
+
+int main() {
+    using namespace std::chrono_literals;
+    double base = rss_mb();
+
+    // Freed on the allocating thread, then trimmed
+    {
+        std::vector<GC::Ptr<Obj>> objects;
+        objects.reserve(kObjects);
+        for (int i = 0; i < kObjects; ++i) {
+            objects.push_back(GC::New<Obj>(i));
+        }
+        double peak = rss_mb() - base;
+        objects.clear();
+        GC::trim();
+        std::printf("local free + trim:        %6.1f MB -> %6.1f MB\n", peak, rss_mb() - base);
+    }
+
+    GC::set_heap_decay(std::chrono::milliseconds(50));
+    GC::start_heap_purger(20ms);
+
+    // Allocated by a thread that has exited, freed here, left to decay
+    {
+        std::vector<GC::Ptr<Obj>> objects;
+        objects.reserve(kObjects);
+        std::thread producer([&] {
+            for (int i = 0; i < kObjects; ++i) {
+                objects.push_back(GC::New<Obj>(i));
+            }
+        });
+        producer.join();
+        double peak = rss_mb() - base;
+        objects.clear();
+        std::this_thread::sleep_for(300ms);
+        std::printf("exited producer, decay:   %6.1f MB -> %6.1f MB\n", peak, rss_mb() - base);
+    }
+
+    // Live producer, consumer frees: a burst is queued, then the consumer
+    // drains it while the producer goes on at a lower rate. The burst's
+    // pages are emptied by remote frees while their owner keeps allocating.
+    {
+        std::mutex mtx;
+        std::vector<GC::Ptr<Obj>> queue;
+        std::atomic<int> phase{ 0 };
+        std::thread producer([&] {
+            for (int i = 0; i < kObjects; ++i) {
+                std::lock_guard<std::mutex> lock(mtx);
+                queue.push_back(GC::New<Obj>(i));
+            }
+            phase = 1;
+            while (phase == 1) {
+                for (int i = 0; i < 100; ++i) {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    queue.push_back(GC::New<Obj>(i));
+                }
+                std::this_thread::sleep_for(1ms);
+            }
+        });
+        while (phase == 0) {
+            std::this_thread::sleep_for(1ms);
+        }
+        double peak = rss_mb() - base;
+        auto until = std::chrono::steady_clock::now() + 300ms;
+        while (std::chrono::steady_clock::now() < until) {
+            std::vector<GC::Ptr<Obj>> taken;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                taken.swap(queue);
+            }
+            taken.clear();
+            std::this_thread::sleep_for(1ms);
+        }
+        std::printf("live producer, decay:     %6.1f MB -> %6.1f MB\n", peak, rss_mb() - base);
+        phase = 2;
+        producer.join();
+    }
+
+    GC::stop_heap_purger();
+    return 0;
+}
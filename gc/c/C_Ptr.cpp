@@ -3,6 +3,9 @@
 #include <memory>
 #include <iostream>
 #include <cstring>
+#include <cstddef>
+#include <new>
+#include <chrono>
 
 struct DebugDeleter {
     void operator()(char* ptr) const noexcept {
@@ -42,5 +45,195 @@ extern "C" {
         return *(PtrBase*)&cpp;
     }
 
+    // `count` chunks of `size` bytes carved from one allocation, each
+    // aligned for any type. Returns the number of chunks (0 on failure).
+    // One granule in front of the first chunk records the slab's size, so
+    // the free can uncount it like the other paths outside the pages.
+    size_t gc_malloc_bulk(size_t size, size_t count, void** out_ptrs) {
+        GC::detail::safepoint_poll();
+        const size_t align = alignof(std::max_align_t);
+        size_t stride = size == 0 ? align : (size + align - 1) / align * align;
+        if (count == 0 || stride < size || count > (static_cast<size_t>(-1) - align) / stride) {
+            return 0;
+        }
+        size_t bytes = align + stride * count;
+        char* slab = static_cast<char*>(::operator new(bytes, std::nothrow));
+        if (!slab) {
+            return 0;
+        }
+        *reinterpret_cast<size_t*>(slab) = bytes;
+        for (size_t i = 0; i < count; ++i) {
+            out_ptrs[i] = slab + align + i * stride;
+        }
+        GC::detail::count_outside_bytes(bytes);
+        return count;
+    }
+
+    // free the whole slab through its first chunk
+    void gc_free_bulk(void* first) {
+        if (!first) {
+            return;
+        }
+        GC::detail::PassTimer timer(GC::Metric::CHeapCollectTime);
+        char* slab = static_cast<char*>(first) - alignof(std::max_align_t);
+        GC::detail::uncount_outside_bytes(*reinterpret_cast<size_t*>(slab));
+        ::operator delete(slab);
+    }
+
+    size_t gc_trim(void) {
+        GC::detail::PassTimer timer(GC::Metric::CHeapCollectTime);
+        return GC::trim();
+    }
+
+    size_t gc_heap_usage(void) {
+        return GC::heap_usage();
+    }
+
+    void gc_set_heap_decay(long long milliseconds) {
+        GC::set_heap_decay(std::chrono::milliseconds(milliseconds));
+    }
+
+    gc_handle_t gc_handle_alloc(size_t size) {
+        try {
+            return GC::make_handle(GC::NewArray<unsigned char>(size));
+        }
+        catch (const std::bad_alloc&) {
+            return GC_NULL_HANDLE;
+        }
+    }
+
+    gc_handle_t gc_handle_dup(gc_handle_t h, gc_handle_kind kind) {
+        auto& table = GC::detail::HandleTable::instance();
+        GC::detail::HandleSlot* s = table.enter(h);
+        if (!s) {
+            return GC_NULL_HANDLE;
+        }
+        gc_handle_t dup = GC_NULL_HANDLE;
+        if (kind == GC_HANDLE_WEAK) {
+            // The entered handle keeps at least the block alive.
+            s->ops->add_weak(s->ctrl);
+            dup = table.create(s->ctrl, s->object.load(std::memory_order_relaxed), s->ops, GC::HandleKind::Weak);
+            if (!dup) {
+                s->ops->release_weak(s->ctrl);
+            }
+        }
+        else if (s->ops->try_add_strong(s->ctrl)) {
+            dup = table.create(s->ctrl, s->object.load(std::memory_order_relaxed), s->ops, GC::HandleKind::Strong);
+            if (!dup) {
+                s->ops->release_strong(s->ctrl);
+            }
+        }
+        table.leave(static_cast<uint32_t>(h), s);
+        return dup;
+    }
+
+    int gc_handle_free(gc_handle_t h) {
+        return GC::free_handle(h) ? 1 : 0;
+    }
+
+    // Strong handles are read without writing to the slot; weak ones enter
+    // it to check the object is still there.
+    void* gc_handle_get(gc_handle_t h) {
+        auto& table = GC::detail::HandleTable::instance();
+        if (void* object = table.peek(h)) {
+            return object;
+        }
+        GC::detail::HandleSlot* s = table.enter(h);
+        if (!s) {
+            return nullptr;
+        }
+        void* object = s->ops->is_alive(s->ctrl) ? s->object.load(std::memory_order_relaxed) : nullptr;
+        table.leave(static_cast<uint32_t>(h), s);
+        return object;
+    }
+
+    // The pin holds a strong reference and keeps the slot from being
+    // recycled, so the unpin finds the block even after gc_handle_free.
+    void* gc_handle_pin(gc_handle_t h) {
+        auto& table = GC::detail::HandleTable::instance();
+        GC::detail::HandleSlot* s = table.enter(h);
+        if (!s) {
+            return nullptr;
+        }
+        if (!s->ops->try_add_strong(s->ctrl)) {
+            table.leave(static_cast<uint32_t>(h), s);
+            return nullptr;
+        }
+        void* object = s->object.load(std::memory_order_relaxed);
+        if (!table.pin(s)) {
+            s->ops->release_strong(s->ctrl);
+            table.leave(static_cast<uint32_t>(h), s);
+            return nullptr;
+        }
+        return object;
+    }
+
+    // Does nothing unless the handle has a pin to give back.
+    void gc_handle_unpin(gc_handle_t h) {
+        auto& table = GC::detail::HandleTable::instance();
+        GC::detail::HandleSlot* s = table.unpin(h);
+        if (!s) {
+            return;
+        }
+        s->ops->release_strong(s->ctrl);
+        table.leave(static_cast<uint32_t>(h), s);
+    }
+
+    int gc_handle_is_weak(gc_handle_t h) {
+        GC::detail::HandleSlot* s = GC::detail::HandleTable::instance().find(h);
+        return s && (s->state.load(std::memory_order_relaxed) & GC::detail::HandleSlot::kWeak) ? 1 : 0;
+    }
+
+    // The header fills one heap granule, so the user pointer keeps the
+    // alignment of the block.
+    static_assert(sizeof(gc_rc_header) % alignof(std::max_align_t) == 0,
+        "gc_rc_header must keep blocks max_align_t-aligned");
+
+    void* gc_rc_malloc(size_t size) {
+        if (size > static_cast<size_t>(-1) - sizeof(gc_rc_header)) {
+            return nullptr;
+        }
+        size_t total = sizeof(gc_rc_header) + size;
+        void* mem;
+        try {
+            mem = GC::detail::heap_allocate(total, alignof(std::max_align_t));
+        }
+        catch (const std::bad_alloc&) {
+            return nullptr;
+        }
+        auto* header = static_cast<gc_rc_header*>(mem);
+        header->count = 1;
+        header->size_class = GC::detail::heap_serves(total, alignof(std::max_align_t))
+            ? static_cast<uint32_t>(GC::detail::ThreadHeap::class_of(total))
+            : GC_RC_LARGE;
+        header->size = size;
+        return header + 1;
+    }
+
+    void* gc_rc_calloc(size_t count, size_t size) {
+        if (size != 0 && count > static_cast<size_t>(-1) / size) {
+            return nullptr;
+        }
+        void* p = gc_rc_malloc(count * size);
+        if (p) {
+            std::memset(p, 0, count * size);
+        }
+        return p;
+    }
+
+    // The size class says which path the block came from, so freeing needs
+    // neither the size passed in nor a lookup: small blocks go back to
+    // their page (found by address), large ones to operator delete.
+    void gc_rc_free(void* p) {
+        if (!p) {
+            return;
+        }
+        gc_rc_header* header = static_cast<gc_rc_header*>(p) - 1;
+        size_t bytes = header->size_class == GC_RC_LARGE
+            ? sizeof(gc_rc_header) + static_cast<size_t>(header->size)
+            : (header->size_class + 1) * GC::detail::ThreadHeap::kGranule;
+        GC::detail::heap_free(header, bytes, alignof(std::max_align_t));
+    }
+
 } // extern "C"
 
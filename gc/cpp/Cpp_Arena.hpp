@@ -0,0 +1,225 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Cpp_Ptr.hpp"
+
+namespace GC {
+
+    namespace detail {
+
+        // Chunks owned by one Arena. Each control block allocated from the
+        // arena holds one reference, the Arena handle holds another; the
+        // chunks are freed in one go when the last of them is gone. They
+        // count in heap_usage() and heap_live() for as long as they exist.
+        class ArenaState {
+        public:
+            explicit ArenaState(size_t chunk_size) noexcept
+                : live_(1), chunk_size_(chunk_size) {
+            }
+
+            ArenaState(const ArenaState&) = delete;
+            ArenaState& operator=(const ArenaState&) = delete;
+
+            void* allocate(size_t size, size_t align) {
+                uintptr_t p = (reinterpret_cast<uintptr_t>(cur_) + (align - 1)) & ~(uintptr_t)(align - 1);
+                size_t grown = 0;
+                if (!cur_ || p + size > reinterpret_cast<uintptr_t>(end_)) {
+                    size_t need = size + align;
+                    size_t bytes = need > chunk_size_ ? need : chunk_size_;
+                    char* chunk = static_cast<char*>(::operator new(bytes));
+                    chunks_.push_back(chunk);
+                    reserved_ += bytes;
+                    grown = bytes;
+                    cur_ = chunk;
+                    end_ = chunk + bytes;
+                    p = (reinterpret_cast<uintptr_t>(cur_) + (align - 1)) & ~(uintptr_t)(align - 1);
+                }
+                cur_ = reinterpret_cast<char*>(p + size);
+                used_ += size;
+                // Last: a pressure response may run here.
+                if (grown) {
+                    count_outside_bytes(grown);
+                }
+                return reinterpret_cast<void*>(p);
+            }
+
+            void retain() noexcept {
+                live_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release() noexcept {
+                if (live_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    for (char* chunk : chunks_) {
+                        ::operator delete(chunk);
+                    }
+                    uncount_outside_bytes(reserved_);
+                    delete this;
+                }
+            }
+
+            size_t bytes_used() const noexcept { return used_; }
+            size_t chunk_count() const noexcept { return chunks_.size(); }
+
+        private:
+            ~ArenaState() = default;
+
+            std::atomic<size_t> live_;
+            size_t chunk_size_;
+            std::vector<char*> chunks_;
+            char* cur_ = nullptr;
+            char* end_ = nullptr;
+            size_t used_ = 0;
+            size_t reserved_ = 0;
+        };
+
+        // Control block living inside an arena. The object is destroyed in
+        // place (not at all if trivially destructible) and neither it nor
+        // the block is freed individually.
+        template<typename T>
+        class ArenaBlock final : public ControlBlock<T> {
+        public:
+            ArenaBlock(T* p, ArenaState* arena) noexcept
+                : ptr_(p), arena_(arena) {
+                arena_->retain();
+                leak_on_block(this, p, AllocSite{ nullptr, 0 });
+            }
+
+        protected:
+            void dispose() noexcept override {
+                if constexpr (!std::is_trivially_destructible_v<T>) {
+                    ptr_->~T();
+                }
+            }
+
+            void destroy() noexcept override {
+                ArenaState* arena = arena_;
+                this->~ArenaBlock();
+                arena->release();
+            }
+
+        private:
+            T* ptr_;
+            ArenaState* arena_;
+        };
+
+        // One element of a NewBatch slab: the object followed by its block.
+        template<typename T>
+        struct BatchSlot {
+            alignas(T) unsigned char object[sizeof(T)];
+            alignas(ArenaBlock<T>) unsigned char block[sizeof(ArenaBlock<T>)];
+        };
+    }
+
+    // Region allocator for object graphs that die together. Objects and
+    // their control blocks are bump-allocated from large chunks; all chunks
+    // are released at once when the Arena and every Ptr into it are gone.
+    // Allocation is not thread-safe, Ptrs into the arena are. A moved-from
+    // Arena is empty and starts new chunks if it is used again.
+    class Arena {
+    public:
+        static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+        explicit Arena(size_t chunk_size = kDefaultChunkSize)
+            : state_(new detail::ArenaState(chunk_size)), chunk_size_(chunk_size) {
+        }
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        Arena(Arena&& other) noexcept : state_(other.state_), chunk_size_(other.chunk_size_) {
+            other.state_ = nullptr;
+        }
+
+        Arena& operator=(Arena&& other) noexcept {
+            if (this != &other) {
+                if (state_) {
+                    state_->release();
+                }
+                state_ = other.state_;
+                chunk_size_ = other.chunk_size_;
+                other.state_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~Arena() {
+            if (state_) {
+                state_->release();
+            }
+        }
+
+        template<typename T, typename... Args>
+        Ptr<T> New(Args&&... args) {
+            detail::safepoint_poll();
+            if (!state_) {
+                state_ = new detail::ArenaState(chunk_size_);
+            }
+            void* block_mem = state_->allocate(sizeof(detail::ArenaBlock<T>), alignof(detail::ArenaBlock<T>));
+            void* obj_mem = state_->allocate(sizeof(T), alignof(T));
+            T* obj = ::new (obj_mem) T(std::forward<Args>(args)...);
+            auto* block = ::new (block_mem) detail::ArenaBlock<T>(obj, state_);
+            return detail::PtrAccess::adopt<T>(block, obj);
+        }
+
+        size_t bytes_used() const noexcept {
+            return state_ ? state_->bytes_used() : 0;
+        }
+
+        size_t chunk_count() const noexcept {
+            return state_ ? state_->chunk_count() : 0;
+        }
+
+    private:
+        detail::ArenaState* state_;
+        size_t chunk_size_;
+    };
+
+    // n objects built as T(init(i)) for i in [0, n), with their control
+    // blocks, in a single slab allocation. The Ptrs are independent; the
+    // slab is freed once the last of them (strong or weak) is gone. When
+    // init returns a T the object is constructed in place, without a move.
+    template<typename T, typename Init>
+    std::vector<Ptr<T>> NewBatch(size_t n, Init init) {
+        using Slot = detail::BatchSlot<T>;
+        std::vector<Ptr<T>> out;
+        if (n == 0) {
+            return out;
+        }
+        if (n > static_cast<size_t>(-1) / sizeof(Slot)) {
+            throw std::bad_array_new_length();
+        }
+        detail::safepoint_poll();
+        out.reserve(n);
+        auto* slab = new detail::ArenaState(0);
+        try {
+            auto* slots = static_cast<Slot*>(slab->allocate(n * sizeof(Slot), alignof(Slot)));
+            for (size_t i = 0; i < n; ++i) {
+                T* obj = ::new (static_cast<void*>(slots[i].object)) T(init(i));
+                auto* block = ::new (static_cast<void*>(slots[i].block)) detail::ArenaBlock<T>(obj, slab);
+                out.push_back(detail::PtrAccess::adopt<T>(block, obj));
+            }
+        }
+        catch (...) {
+            out.clear();
+            slab->release();
+            throw;
+        }
+        slab->release();
+        return out;
+    }
+
+    // n value-initialized objects.
+    template<typename T>
+    std::vector<Ptr<T>> NewBatch(size_t n) {
+        return NewBatch<T>(n, [](size_t) { return T(); });
+    }
+
+}
@@ -0,0 +1,233 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace GC {
+
+    namespace detail {
+
+        using CountApply = void (*)(void*, long) noexcept;
+
+        // Per-thread log of strong count changes, one net delta per block.
+        // Small and fixed so logging never allocates.
+        struct CountBuffer {
+            static constexpr size_t kEntries = 64;
+            static constexpr size_t kFlushOps = 4096;
+
+            struct Entry {
+                void* ctrl;
+                long delta;
+                CountApply apply;
+            };
+
+            Entry entries[kEntries];
+            size_t size = 0;
+            size_t ops = 0;
+            size_t last = 0;
+            uint64_t checked_gen = 0;
+            bool registered = false;
+
+            ~CountBuffer();
+        };
+
+        inline thread_local CountBuffer count_buffer;
+
+        // Net decrements waiting to be applied. One stamped with generation
+        // g is applied once every registered thread has flushed in a later
+        // generation, so every increment that happened before it has reached
+        // the shared counter first and no count drops to zero early.
+        struct CoalesceState {
+            struct Pending {
+                void* ctrl;
+                long delta;
+                CountApply apply;
+                uint64_t gen;
+            };
+
+            std::atomic<bool> enabled{ false };
+            std::mutex mtx;
+            uint64_t gen = 1;
+            std::vector<Pending> pending;
+            std::vector<CountBuffer*> threads;
+
+            static CoalesceState& instance() {
+                static CoalesceState* state = new CoalesceState();
+                return *state;
+            }
+
+            // Moves out the entries every thread has flushed past. Call with
+            // `mtx` held.
+            void take_ready(std::vector<Pending>& ready) {
+                uint64_t oldest = UINT64_MAX;
+                bool all_checked = true;
+                for (const CountBuffer* t : threads) {
+                    oldest = std::min(oldest, t->checked_gen);
+                    all_checked = all_checked && t->checked_gen == gen;
+                }
+                if (all_checked) {
+                    ++gen;
+                }
+                auto keep = pending.begin();
+                for (auto it = pending.begin(); it != pending.end(); ++it) {
+                    if (it->gen < oldest) {
+                        ready.push_back(*it);
+                    }
+                    else {
+                        *keep++ = *it;
+                    }
+                }
+                pending.erase(keep, pending.end());
+            }
+        };
+
+        inline bool coalescing_active() noexcept {
+            return CoalesceState::instance().enabled.load(std::memory_order_relaxed);
+        }
+
+        // Publishes a thread's buffer and applies the decrements that are
+        // now safe. Applying one may run destructors that log again, so no
+        // lock is held and the buffer is emptied first. Another thread may
+        // flush `b` only while its owner is held in a handshake.
+        inline size_t flush_count_buffer(CountBuffer& b) noexcept {
+            CoalesceState& s = CoalesceState::instance();
+            CountBuffer::Entry local[CountBuffer::kEntries];
+            size_t n = b.size;
+            std::copy(b.entries, b.entries + n, local);
+            b.size = 0;
+            b.ops = 0;
+            b.last = 0;
+
+            for (size_t i = 0; i < n; ++i) {
+                if (local[i].delta > 0) {
+                    local[i].apply(local[i].ctrl, local[i].delta);
+                }
+            }
+
+            std::vector<CoalesceState::Pending> ready;
+            {
+                std::lock_guard<std::mutex> lock(s.mtx);
+                for (size_t i = 0; i < n; ++i) {
+                    if (local[i].delta < 0) {
+                        s.pending.push_back({ local[i].ctrl, local[i].delta, local[i].apply, s.gen });
+                    }
+                }
+                if (b.registered) {
+                    b.checked_gen = s.gen;
+                }
+                s.take_ready(ready);
+            }
+            for (const auto& p : ready) {
+                p.apply(p.ctrl, p.delta);
+            }
+            return ready.size();
+        }
+
+        inline size_t flush_count_buffer() noexcept {
+            return flush_count_buffer(count_buffer);
+        }
+
+        inline void coalesce_delta(void* ctrl, long delta, CountApply apply) noexcept {
+            CountBuffer& b = count_buffer;
+            if (!b.registered) {
+                CoalesceState& s = CoalesceState::instance();
+                std::lock_guard<std::mutex> lock(s.mtx);
+                b.checked_gen = s.gen;
+                b.registered = true;
+                s.threads.push_back(&b);
+            }
+
+            // An entry names a block by address and counter layout: once its
+            // delta is back to zero nothing keeps the block alive, and a block
+            // of another layout may take its address.
+            auto matches = [&](const CountBuffer::Entry& x) {
+                return x.ctrl == ctrl && x.apply == apply;
+            };
+            CountBuffer::Entry* e = nullptr;
+            if (b.last < b.size && matches(b.entries[b.last])) {
+                e = &b.entries[b.last];
+            }
+            else {
+                for (size_t i = 0; i < b.size; ++i) {
+                    if (matches(b.entries[i])) {
+                        e = &b.entries[i];
+                        b.last = i;
+                        break;
+                    }
+                }
+            }
+            if (!e) {
+                while (b.size == CountBuffer::kEntries) {
+                    flush_count_buffer();
+                }
+                b.last = b.size++;
+                e = &b.entries[b.last];
+                *e = CountBuffer::Entry{ ctrl, 0, apply };
+            }
+            e->delta += delta;
+            if (e->delta == 0) {
+                *e = b.entries[--b.size];
+                b.last = 0;
+            }
+
+            if (++b.ops >= CountBuffer::kFlushOps) {
+                flush_count_buffer();
+            }
+        }
+
+        inline CountBuffer::~CountBuffer() {
+            if (!registered) {
+                return;
+            }
+            while (size > 0) {
+                flush_count_buffer();
+            }
+            CoalesceState& s = CoalesceState::instance();
+            std::vector<CoalesceState::Pending> ready;
+            {
+                std::lock_guard<std::mutex> lock(s.mtx);
+                s.threads.erase(std::remove(s.threads.begin(), s.threads.end(), this), s.threads.end());
+                registered = false;
+                s.take_ready(ready);
+            }
+            for (const auto& p : ready) {
+                p.apply(p.ctrl, p.delta);
+            }
+        }
+
+        template<typename Block> void apply_coalesced(void* ctrl, long delta) noexcept;
+    }
+
+    // In coalesced mode add_strong/release_strong only update a per-thread
+    // buffer; net deltas reach the shared counter when the buffer is flushed,
+    // and decrements only once every thread has flushed after them. Hot
+    // objects copied and dropped on many threads then cause no atomic traffic.
+    //
+    // strong_count() lags behind while deltas are buffered, and a count that
+    // reaches zero is only acted on after the flushes. A thread that has used
+    // this mode holds reclamation back until it flushes again or exits, so
+    // long-lived threads must call flush_counts() periodically. Turn the mode
+    // off only after every thread has flushed.
+    inline void enable_coalesced_rc(bool enabled = true) noexcept {
+        detail::CoalesceState::instance().enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    // Flushes this thread's count buffer. Returns the number of buffered
+    // decrements that were applied to shared counters.
+    inline size_t flush_counts() noexcept {
+        return detail::flush_count_buffer();
+    }
+
+    // Net decrements flushed but not yet applied.
+    inline size_t coalesced_pending() {
+        detail::CoalesceState& s = detail::CoalesceState::instance();
+        std::lock_guard<std::mutex> lock(s.mtx);
+        return s.pending.size();
+    }
+
+}
@@ -0,0 +1,133 @@
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+#include "Cpp_Ptr.hpp"
+#include "Cpp_Epoch.hpp"
+
+namespace GC {
+
+    // Lock-free LIFO of Ptrs (Treiber stack). push() and pop() move the Ptr
+    // in and out, so its reference counts are never touched. Popped nodes
+    // are freed through an EpochDomain: a node cannot be reused while
+    // another pop may still hold its address, which rules out ABA.
+    template<typename T>
+    class ConcurrentStack {
+    public:
+        explicit ConcurrentStack(EpochDomain& domain = EpochDomain::global())
+            : domain_(domain), head_(nullptr) {
+        }
+
+        ConcurrentStack(const ConcurrentStack&) = delete;
+        ConcurrentStack& operator=(const ConcurrentStack&) = delete;
+
+        // No other operation may run concurrently.
+        ~ConcurrentStack() {
+            Node* node = head_.load(std::memory_order_acquire);
+            while (node) {
+                Node* next = node->next;
+                delete node;
+                node = next;
+            }
+        }
+
+        void push(Ptr<T> value) {
+            Node* node = new Node{ std::move(value), head_.load(std::memory_order_relaxed) };
+            while (!head_.compare_exchange_weak(node->next, node,
+                std::memory_order_release, std::memory_order_relaxed)) {
+            }
+        }
+
+        // Empty Ptr if the stack is empty.
+        Ptr<T> pop() {
+            Node* node;
+            {
+                ReadGuard guard(domain_);
+                node = head_.load(std::memory_order_acquire);
+                while (node && !head_.compare_exchange_weak(node, node->next,
+                    std::memory_order_acquire, std::memory_order_acquire)) {
+                }
+            }
+            if (!node) {
+                return Ptr<T>();
+            }
+            Ptr<T> value = std::move(node->value);
+            domain_.retire_node(node);
+            return value;
+        }
+
+        bool empty() const noexcept {
+            return head_.load(std::memory_order_acquire) == nullptr;
+        }
+
+    private:
+        // `next` never changes once the node is published.
+        struct Node {
+            Ptr<T> value;
+            Node* next;
+        };
+
+        EpochDomain& domain_;
+        std::atomic<Node*> head_;
+    };
+
+    // Multi-producer, single-consumer FIFO of Ptrs (Vyukov's queue). push()
+    // is one exchange and may run on any thread; pop() must only ever run
+    // on one thread at a time. Values are moved, never copied. A producer
+    // stalled between its two steps hides the elements pushed after it
+    // until it resumes.
+    template<typename T>
+    class MPSCQueue {
+    public:
+        MPSCQueue() : tail_(new Node()), head_(tail_.load(std::memory_order_relaxed)) {}
+
+        MPSCQueue(const MPSCQueue&) = delete;
+        MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+        // No other operation may run concurrently.
+        ~MPSCQueue() {
+            while (head_) {
+                Node* next = head_->next.load(std::memory_order_acquire);
+                delete head_;
+                head_ = next;
+            }
+        }
+
+        void push(Ptr<T> value) {
+            Node* node = new Node{ std::move(value) };
+            Node* prev = tail_.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+
+        // Empty Ptr if nothing is ready. Consumer only.
+        Ptr<T> pop() {
+            Node* next = head_->next.load(std::memory_order_acquire);
+            if (!next) {
+                return Ptr<T>();
+            }
+            // `next` becomes the new stub; its value moves out.
+            Ptr<T> value = std::move(next->value);
+            delete head_;
+            head_ = next;
+            return value;
+        }
+
+        // Consumer only.
+        bool empty() const noexcept {
+            return head_->next.load(std::memory_order_acquire) == nullptr;
+        }
+
+    private:
+        struct Node {
+            Ptr<T> value;
+            std::atomic<Node*> next{ nullptr };
+        };
+
+        // Producers and the consumer touch different lines.
+        alignas(detail::kCacheLine) std::atomic<Node*> tail_;
+        alignas(detail::kCacheLine) Node* head_;
+    };
+
+}
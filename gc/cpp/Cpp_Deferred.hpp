@@ -0,0 +1,166 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace GC {
+
+    namespace detail {
+
+        // Thread-local list of the control blocks named by live StackRefs.
+        // Only the owning thread reads or writes it.
+        struct DeferredThread {
+            std::vector<const void*> refs;
+            uint64_t checked_gen = 0;
+            bool registered = false;
+
+            ~DeferredThread();
+        };
+
+        inline thread_local DeferredThread deferred_thread;
+
+        // Zero-count table: blocks whose strong count reached zero while
+        // deferred reference counting was on. An entry stamped with
+        // generation g is finalized once every registered thread has passed
+        // a safe point in a later generation without naming it.
+        struct DeferredState {
+            struct Entry {
+                void (*finish)(void*) noexcept;
+                uint64_t gen;
+            };
+
+            std::atomic<bool> enabled{ false };
+            std::mutex mtx;
+            uint64_t gen = 1;
+            std::unordered_map<void*, Entry> zct;
+            std::vector<DeferredThread*> threads;
+
+            static DeferredState& instance() {
+                static DeferredState* state = new DeferredState();
+                return *state;
+            }
+        };
+
+        inline bool deferred_rc_active() noexcept {
+            return DeferredState::instance().enabled.load(std::memory_order_relaxed);
+        }
+
+        // Returns false if the block was already in the table (it was
+        // revived and dropped to zero again); the entry is re-stamped.
+        inline bool defer_zero_count(void* ctrl, void (*finish)(void*) noexcept) {
+            DeferredState& s = DeferredState::instance();
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto it = s.zct.find(ctrl);
+            if (it == s.zct.end()) {
+                s.zct.emplace(ctrl, DeferredState::Entry{ finish, s.gen });
+                return true;
+            }
+            it->second.gen = s.gen;
+            return false;
+        }
+
+        inline void register_deferred_thread(DeferredThread& t) {
+            DeferredState& s = DeferredState::instance();
+            std::lock_guard<std::mutex> lock(s.mtx);
+            t.checked_gen = s.gen;
+            t.registered = true;
+            s.threads.push_back(&t);
+        }
+
+        inline DeferredThread::~DeferredThread() {
+            if (registered) {
+                DeferredState& s = DeferredState::instance();
+                std::lock_guard<std::mutex> lock(s.mtx);
+                s.threads.erase(std::remove(s.threads.begin(), s.threads.end(), this), s.threads.end());
+            }
+        }
+
+        inline size_t stack_ref_push(const void* ctrl) {
+            DeferredThread& t = deferred_thread;
+            if (!t.registered) {
+                register_deferred_thread(t);
+            }
+            t.refs.push_back(ctrl);
+            return t.refs.size() - 1;
+        }
+
+        inline void stack_ref_pop(size_t slot) noexcept {
+            auto& refs = deferred_thread.refs;
+            refs[slot] = nullptr;
+            while (!refs.empty() && refs.back() == nullptr) {
+                refs.pop_back();
+            }
+        }
+
+        template<typename Block> void finish_deferred(void* ctrl) noexcept;
+    }
+
+    // In deferred mode a strong count reaching zero does not destroy the
+    // object; the block goes to the zero-count table instead, so StackRefs
+    // (which are not counted) stay valid until the next safe points.
+    inline void enable_deferred_rc(bool enabled = true) noexcept {
+        detail::DeferredState::instance().enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    // Safe point for deferred reference counting. Records that this thread
+    // has passed a safe point, pins the zero-count blocks its StackRefs still
+    // name, and finalizes the blocks every thread has released. Threads that
+    // use StackRef must call this periodically. Returns the number of blocks
+    // finalized.
+    inline size_t reconcile() {
+        detail::DeferredState& s = detail::DeferredState::instance();
+        detail::DeferredThread& self = detail::deferred_thread;
+        std::vector<std::pair<void*, void (*)(void*) noexcept>> ready;
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            self.checked_gen = s.gen;
+            for (const void* ref : self.refs) {
+                if (ref) {
+                    auto it = s.zct.find(const_cast<void*>(ref));
+                    if (it != s.zct.end()) {
+                        it->second.gen = s.gen;
+                    }
+                }
+            }
+
+            uint64_t oldest = UINT64_MAX;
+            bool all_checked = true;
+            for (const detail::DeferredThread* t : s.threads) {
+                oldest = std::min(oldest, t->checked_gen);
+                all_checked = all_checked && t->checked_gen == s.gen;
+            }
+            if (all_checked) {
+                ++s.gen;
+            }
+
+            for (auto it = s.zct.begin(); it != s.zct.end();) {
+                if (it->second.gen < oldest) {
+                    ready.emplace_back(it->first, it->second.finish);
+                    it = s.zct.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        for (const auto& r : ready) {
+            r.second(r.first);
+        }
+        return ready.size();
+    }
+
+    // Blocks waiting in the zero-count table.
+    inline size_t deferred_pending() {
+        detail::DeferredState& s = detail::DeferredState::instance();
+        std::lock_guard<std::mutex> lock(s.mtx);
+        return s.zct.size();
+    }
+
+}
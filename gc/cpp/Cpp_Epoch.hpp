@@ -0,0 +1,333 @@
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Cpp_Ptr.hpp"
+
+namespace GC {
+
+    class EpochDomain;
+
+    namespace detail {
+
+        // One thread's state inside one domain. Records are never freed
+        // before their domain; a thread that exits hands its record back.
+        struct alignas(64) EpochRecord {
+            std::atomic<uint64_t> epoch{ 0 };   // 0 while outside any ReadGuard
+            std::atomic<bool> in_use{ true };
+            unsigned depth = 0;
+            EpochRecord* next = nullptr;
+            std::vector<RetiredRef> retired;
+        };
+
+        // Domains alive right now, so exiting threads never touch a
+        // destroyed one.
+        struct EpochDomainRegistry {
+            std::mutex mtx;
+            std::unordered_set<uint64_t> live;
+            uint64_t next_id = 1;
+
+            static EpochDomainRegistry& instance() {
+                static EpochDomainRegistry* reg = new EpochDomainRegistry();
+                return *reg;
+            }
+        };
+
+        struct EpochThreadCache {
+            struct Entry {
+                EpochDomain* domain;
+                uint64_t id;
+                EpochRecord* record;
+            };
+
+            std::vector<Entry> entries;
+
+            ~EpochThreadCache();
+        };
+
+        inline thread_local EpochThreadCache epoch_thread_cache;
+
+        template<typename N>
+        void delete_retired(void* node) noexcept {
+            delete static_cast<N*>(node);
+        }
+    }
+
+    // Epoch-based reclamation. Readers enter a ReadGuard and may then follow
+    // strong Ptrs with get()/operator-> without touching reference counts.
+    // Writers unlink nodes with replace()/retire(); the strong reference they
+    // held is dropped only once every reader that could still see the node
+    // has left its ReadGuard.
+    //
+    // A domain must outlive the ReadGuards and retire() calls made on it.
+    class EpochDomain {
+    public:
+        static constexpr size_t kCollectThreshold = 64;
+
+        EpochDomain() {
+            auto& reg = detail::EpochDomainRegistry::instance();
+            std::lock_guard<std::mutex> lock(reg.mtx);
+            id_ = reg.next_id++;
+            reg.live.insert(id_);
+        }
+
+        EpochDomain(const EpochDomain&) = delete;
+        EpochDomain& operator=(const EpochDomain&) = delete;
+
+        // No ReadGuard may be active. Everything still retired is released.
+        ~EpochDomain() {
+            {
+                auto& reg = detail::EpochDomainRegistry::instance();
+                std::lock_guard<std::mutex> lock(reg.mtx);
+                reg.live.erase(id_);
+            }
+            std::vector<detail::RetiredRef> pending;
+            detail::EpochRecord* rec = records_.exchange(nullptr, std::memory_order_acq_rel);
+            while (rec) {
+                assert(rec->epoch.load(std::memory_order_relaxed) == 0 && "EpochDomain destroyed inside a ReadGuard");
+                pending.insert(pending.end(), rec->retired.begin(), rec->retired.end());
+                detail::EpochRecord* next = rec->next;
+                delete rec;
+                rec = next;
+            }
+            pending.insert(pending.end(), orphans_.begin(), orphans_.end());
+            for (const auto& r : pending) {
+                r.release(r.ctrl);
+            }
+        }
+
+        static EpochDomain& global() {
+            static EpochDomain* domain = new EpochDomain();
+            return *domain;
+        }
+
+        // Defers dropping the strong reference held by `p`.
+        template<typename T>
+        void retire(Ptr<T> p) {
+            if (!p || p.is_weak()) {
+                return;
+            }
+            retire_block<T>(detail::PtrAccess::detach(p));
+        }
+
+        // Defers `delete node` the same way, for the nodes of lock-free
+        // structures that are not managed objects themselves.
+        template<typename N>
+        void retire_node(N* node) {
+            retire_entry(node, &detail::delete_retired<N>);
+        }
+
+        // Publishes `value` in `slot` with a single atomic exchange and
+        // retires the previous target, so concurrent readers see either.
+        // Meanwhile other threads may only read `slot` with get()/-> in a
+        // ReadGuard; copying, casting or resetting it races with the update.
+        template<typename T>
+        void replace(Ptr<T>& slot, Ptr<T> value) {
+            ControlBlock<T>* old = detail::PtrAccess::exchange(slot, std::move(value));
+            if (old) {
+                retire_block<T>(old);
+            }
+        }
+
+        // Waits for all current readers and releases everything this thread
+        // and exited threads have retired. Must not be called in a ReadGuard.
+        void synchronize() {
+            detail::EpochRecord* rec = local();
+            assert(rec->depth == 0 && "synchronize() inside a ReadGuard");
+            for (int i = 0; i < 2; ++i) {
+                uint64_t target = global_epoch_.load(std::memory_order_acquire) + 1;
+                while (!try_advance() && global_epoch_.load(std::memory_order_acquire) < target) {
+                    std::this_thread::yield();
+                }
+            }
+            collect(*rec);
+            collect_orphans(true);
+        }
+
+        // Retired by this thread and not released yet.
+        size_t pending() {
+            return local()->retired.size();
+        }
+
+        uint64_t epoch() const noexcept {
+            return global_epoch_.load(std::memory_order_acquire);
+        }
+
+    private:
+        friend class ReadGuard;
+        friend struct detail::EpochThreadCache;
+
+        template<typename T>
+        void retire_block(ControlBlock<T>* ctrl) {
+            retire_entry(ctrl, &detail::release_retired<T>);
+        }
+
+        void retire_entry(void* ctrl, void (*release)(void*) noexcept) {
+            detail::EpochRecord* rec = local();
+            rec->retired.push_back(detail::RetiredRef{
+                ctrl, release, global_epoch_.load(std::memory_order_acquire) });
+            if (rec->retired.size() >= kCollectThreshold) {
+                try_advance();
+                collect(*rec);
+                collect_orphans(false);
+            }
+        }
+
+        void enter(detail::EpochRecord* rec) noexcept {
+            if (rec->depth++ == 0) {
+                rec->epoch.store(global_epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        void leave(detail::EpochRecord* rec) noexcept {
+            if (--rec->depth == 0) {
+                rec->epoch.store(0, std::memory_order_release);
+            }
+        }
+
+        // Moves the global epoch forward if every active reader has seen it.
+        bool try_advance() noexcept {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint64_t e = global_epoch_.load(std::memory_order_acquire);
+            for (detail::EpochRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+                uint64_t seen = r->epoch.load(std::memory_order_acquire);
+                if (seen != 0 && seen != e) {
+                    return false;
+                }
+            }
+            return global_epoch_.compare_exchange_strong(e, e + 1, std::memory_order_acq_rel);
+        }
+
+        // Releases entries retired at least two epochs ago. Releasing can
+        // run destructors that retire again, so the safe entries are moved
+        // out before any of them runs.
+        void collect(detail::EpochRecord& rec) {
+            uint64_t e = global_epoch_.load(std::memory_order_acquire);
+            std::vector<detail::RetiredRef> ready;
+            auto keep = rec.retired.begin();
+            for (auto it = rec.retired.begin(); it != rec.retired.end(); ++it) {
+                if (it->epoch + 2 <= e) {
+                    ready.push_back(*it);
+                }
+                else {
+                    *keep++ = *it;
+                }
+            }
+            rec.retired.erase(keep, rec.retired.end());
+            for (const auto& r : ready) {
+                r.release(r.ctrl);
+            }
+        }
+
+        void collect_orphans(bool wait) {
+            std::unique_lock<std::mutex> lock(orphan_mtx_, std::defer_lock);
+            if (wait) {
+                lock.lock();
+            }
+            else if (!lock.try_lock()) {
+                return;
+            }
+            if (orphans_.empty()) {
+                return;
+            }
+            detail::EpochRecord tmp;
+            tmp.retired.swap(orphans_);
+            lock.unlock();
+            collect(tmp);
+            if (!tmp.retired.empty()) {
+                lock.lock();
+                orphans_.insert(orphans_.end(), tmp.retired.begin(), tmp.retired.end());
+            }
+        }
+
+        detail::EpochRecord* local() {
+            auto& cache = detail::epoch_thread_cache.entries;
+            for (auto& e : cache) {
+                if (e.domain == this && e.id == id_) {
+                    return e.record;
+                }
+            }
+            detail::EpochRecord* rec = acquire_record();
+            cache.push_back({ this, id_, rec });
+            return rec;
+        }
+
+        detail::EpochRecord* acquire_record() {
+            for (detail::EpochRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+                bool free = false;
+                if (!r->in_use.load(std::memory_order_relaxed) &&
+                    r->in_use.compare_exchange_strong(free, true, std::memory_order_acquire)) {
+                    return r;
+                }
+            }
+            auto* rec = new detail::EpochRecord();
+            rec->next = records_.load(std::memory_order_relaxed);
+            while (!records_.compare_exchange_weak(rec->next, rec,
+                std::memory_order_release, std::memory_order_relaxed)) {
+            }
+            return rec;
+        }
+
+        // Called when a thread exits: its pending retirements become orphans.
+        void detach(detail::EpochRecord* rec) {
+            if (!rec->retired.empty()) {
+                std::lock_guard<std::mutex> lock(orphan_mtx_);
+                orphans_.insert(orphans_.end(), rec->retired.begin(), rec->retired.end());
+                rec->retired.clear();
+            }
+            rec->depth = 0;
+            rec->epoch.store(0, std::memory_order_release);
+            rec->in_use.store(false, std::memory_order_release);
+        }
+
+        alignas(64) std::atomic<uint64_t> global_epoch_{ 1 };
+        alignas(64) std::atomic<detail::EpochRecord*> records_{ nullptr };
+        std::mutex orphan_mtx_;
+        std::vector<detail::RetiredRef> orphans_;
+        uint64_t id_ = 0;
+    };
+
+    // Read-side critical section. Nested guards are free; only the outermost
+    // one publishes the thread's epoch.
+    class ReadGuard {
+    public:
+        explicit ReadGuard(EpochDomain& domain = EpochDomain::global())
+            : domain_(domain), record_(domain.local()) {
+            domain_.enter(record_);
+        }
+
+        ~ReadGuard() {
+            domain_.leave(record_);
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        EpochDomain& domain_;
+        detail::EpochRecord* record_;
+    };
+
+    namespace detail {
+
+        inline EpochThreadCache::~EpochThreadCache() {
+            auto& reg = EpochDomainRegistry::instance();
+            std::lock_guard<std::mutex> lock(reg.mtx);
+            for (auto& e : entries) {
+                if (reg.live.count(e.id)) {
+                    e.domain->detach(e.record);
+                }
+            }
+        }
+    }
+
+}
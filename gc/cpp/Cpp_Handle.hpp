@@ -0,0 +1,353 @@
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include "Cpp_Ptr.hpp"
+
+namespace GC {
+
+    // What a handle holds on its object: a strong reference (keeps it
+    // alive) or a weak one (only the control block).
+    enum class HandleKind {
+        Strong = 0,
+        Weak = 1
+    };
+
+    namespace detail {
+
+        // The count operations a handle needs, bound to one counter layout
+        // so that slots can hold any ControlBlock.
+        struct HandleOps {
+            bool (*try_add_strong)(void*) noexcept;
+            void (*add_weak)(void*) noexcept;
+            void (*release_strong)(void*) noexcept;
+            void (*release_weak)(void*) noexcept;
+            bool (*is_alive)(const void*) noexcept;
+        };
+
+        template<typename Block>
+        const HandleOps* handle_ops() noexcept {
+            static const HandleOps ops{
+                [](void* c) noexcept { return static_cast<Block*>(c)->try_add_strong(); },
+                [](void* c) noexcept { static_cast<Block*>(c)->add_weak(); },
+                [](void* c) noexcept { static_cast<Block*>(c)->release_strong(); },
+                [](void* c) noexcept { static_cast<Block*>(c)->release_weak(); },
+                [](const void* c) noexcept { return static_cast<const Block*>(c)->is_alive(); },
+            };
+            return &ops;
+        }
+
+        // A handle is (generation << 32) | index. The slot's state word holds
+        // the generation in its high half; the low half holds the kind/live
+        // bits, the number of threads inside the slot and the number of pins,
+        // so validating a handle and entering its slot is one CAS. While
+        // entered or pinned a slot is never recycled, which is what makes its
+        // plain fields safe to read. Pins have their own count so that an
+        // unpin without a pin can be told apart from a thread passing by.
+        struct HandleSlot {
+            static constexpr uint64_t kLive = 1;
+            static constexpr uint64_t kWeak = 2;
+            static constexpr uint64_t kEnter = 4;
+            static constexpr uint64_t kEnterMask = 0xFFFCull;
+            static constexpr uint64_t kPin = 1ull << 16;
+            static constexpr uint64_t kPinMask = 0xFFFF0000ull;
+            static constexpr uint64_t kHeldMask = kEnterMask | kPinMask;
+
+            std::atomic<uint64_t> state{ uint64_t(1) << 32 };
+            std::atomic<uint32_t> next_free{ 0 };
+            void* ctrl = nullptr;
+            std::atomic<void*> object{ nullptr };   // atomic for peek()
+            const HandleOps* ops = nullptr;
+        };
+
+        // Slots live in chunks that are allocated on first use and never
+        // freed, so a lookup is two loads and no lock. Free slots form a
+        // lock-free stack whose head carries an ABA tag.
+        class HandleTable {
+        public:
+            static constexpr uint32_t kChunkBits = 12;
+            static constexpr uint32_t kChunkSlots = 1u << kChunkBits;
+            static constexpr uint32_t kMaxChunks = 1u << 14;
+
+            static HandleTable& instance() {
+                static HandleTable* t = new HandleTable();
+                return *t;
+            }
+
+            // 0 when the table is full.
+            uint64_t create(void* ctrl, void* object, const HandleOps* ops, HandleKind kind) {
+                uint32_t index = pop_free();
+                if (index == 0) {
+                    index = next_index_.fetch_add(1, std::memory_order_relaxed);
+                    if (index >= kChunkSlots * kMaxChunks || !ensure_chunk(index)) {
+                        return 0;
+                    }
+                }
+                HandleSlot& s = slot(index);
+                s.ctrl = ctrl;
+                s.object.store(object, std::memory_order_relaxed);
+                s.ops = ops;
+                uint64_t gen = s.state.load(std::memory_order_relaxed) >> 32;
+                s.state.store((gen << 32) | HandleSlot::kLive | (kind == HandleKind::Weak ? HandleSlot::kWeak : 0),
+                    std::memory_order_release);
+                live_.fetch_add(1, std::memory_order_relaxed);
+                return (gen << 32) | index;
+            }
+
+            // Pins the slot of a live handle; null for stale or freed ones.
+            HandleSlot* enter(uint64_t handle) noexcept {
+                HandleSlot* s = find(handle);
+                if (!s) {
+                    return nullptr;
+                }
+                uint64_t st = s->state.load(std::memory_order_relaxed);
+                do {
+                    if ((st >> 32) != (handle >> 32) || !(st & HandleSlot::kLive)) {
+                        return nullptr;
+                    }
+                } while (!s->state.compare_exchange_weak(st, st + HandleSlot::kEnter,
+                    std::memory_order_acquire, std::memory_order_relaxed));
+                return s;
+            }
+
+            // The last one out of a freed slot recycles it.
+            void leave(uint32_t index, HandleSlot* s) noexcept {
+                uint64_t st = s->state.fetch_sub(HandleSlot::kEnter, std::memory_order_acq_rel) - HandleSlot::kEnter;
+                assert(((st + HandleSlot::kEnter) & HandleSlot::kEnterMask) != 0 && "left more often than entered");
+                if (!(st & HandleSlot::kLive) && (st & HandleSlot::kHeldMask) == 0) {
+                    recycle(index, s, st);
+                }
+            }
+
+            // Turns the caller's entry into a pin, which keeps the slot after
+            // the caller returns. False (still entered) if the slot has as
+            // many pins as the count can hold.
+            bool pin(HandleSlot* s) noexcept {
+                uint64_t st = s->state.load(std::memory_order_relaxed);
+                do {
+                    if ((st & HandleSlot::kPinMask) == HandleSlot::kPinMask) {
+                        return false;
+                    }
+                } while (!s->state.compare_exchange_weak(st, st - HandleSlot::kEnter + HandleSlot::kPin,
+                    std::memory_order_relaxed, std::memory_order_relaxed));
+                return true;
+            }
+
+            // Turns one pin of the handle back into an entry, to be ended with
+            // leave(). Null if the handle is stale or has no pins, so a stray
+            // unpin cannot take a reference it does not own.
+            HandleSlot* unpin(uint64_t handle) noexcept {
+                HandleSlot* s = find(handle);
+                if (!s) {
+                    return nullptr;
+                }
+                uint64_t st = s->state.load(std::memory_order_relaxed);
+                do {
+                    if ((st >> 32) != (handle >> 32) || (st & HandleSlot::kPinMask) == 0) {
+                        return nullptr;
+                    }
+                } while (!s->state.compare_exchange_weak(st, st - HandleSlot::kPin + HandleSlot::kEnter,
+                    std::memory_order_acquire, std::memory_order_relaxed));
+                return s;
+            }
+
+            // Marks the handle dead and drops its reference. False for stale
+            // handles.
+            bool destroy(uint64_t handle) noexcept {
+                HandleSlot* s = enter(handle);
+                if (!s) {
+                    return false;
+                }
+                uint64_t st = s->state.load(std::memory_order_relaxed);
+                do {
+                    if (!(st & HandleSlot::kLive)) {
+                        leave(static_cast<uint32_t>(handle), s);
+                        return false;
+                    }
+                } while (!s->state.compare_exchange_weak(st, st & ~HandleSlot::kLive,
+                    std::memory_order_acq_rel, std::memory_order_relaxed));
+                live_.fetch_sub(1, std::memory_order_relaxed);
+                if (st & HandleSlot::kWeak) {
+                    s->ops->release_weak(s->ctrl);
+                }
+                else {
+                    s->ops->release_strong(s->ctrl);
+                }
+                leave(static_cast<uint32_t>(handle), s);
+                return true;
+            }
+
+            // The slot of `handle` if its generation still matches, live or
+            // freed-but-pinned.
+            HandleSlot* find(uint64_t handle) const noexcept {
+                uint32_t index = static_cast<uint32_t>(handle);
+                if (index == 0 || index >= kChunkSlots * kMaxChunks) {
+                    return nullptr;
+                }
+                HandleSlot* chunk = chunks_[index >> kChunkBits].load(std::memory_order_acquire);
+                if (!chunk) {
+                    return nullptr;
+                }
+                HandleSlot* s = &chunk[index & (kChunkSlots - 1)];
+                if ((s->state.load(std::memory_order_acquire) >> 32) != (handle >> 32)) {
+                    return nullptr;
+                }
+                return s;
+            }
+
+            // Object of a live strong handle without entering its slot: the
+            // generation is checked again after reading, so a slot recycled
+            // meanwhile is noticed. Null otherwise (stale, weak or freed).
+            void* peek(uint64_t handle) const noexcept {
+                HandleSlot* s = find(handle);
+                if (!s) {
+                    return nullptr;
+                }
+                uint64_t st = s->state.load(std::memory_order_acquire);
+                if ((st >> 32) != (handle >> 32) || (st & (HandleSlot::kLive | HandleSlot::kWeak)) != HandleSlot::kLive) {
+                    return nullptr;
+                }
+                void* object = s->object.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                uint64_t again = s->state.load(std::memory_order_relaxed);
+                return (again >> 32) == (st >> 32) && (again & HandleSlot::kLive) ? object : nullptr;
+            }
+
+            size_t live() const noexcept {
+                return live_.load(std::memory_order_relaxed);
+            }
+
+        private:
+            HandleTable() = default;
+
+            HandleSlot& slot(uint32_t index) noexcept {
+                return chunks_[index >> kChunkBits].load(std::memory_order_acquire)[index & (kChunkSlots - 1)];
+            }
+
+            bool ensure_chunk(uint32_t index) {
+                std::atomic<HandleSlot*>& c = chunks_[index >> kChunkBits];
+                if (c.load(std::memory_order_acquire)) {
+                    return true;
+                }
+                auto* fresh = new (std::nothrow) HandleSlot[kChunkSlots];
+                if (!fresh) {
+                    return false;
+                }
+                HandleSlot* expected = nullptr;
+                if (!c.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+                    delete[] fresh;
+                }
+                return true;
+            }
+
+            // A new generation makes every copy of the old handle stale.
+            void recycle(uint32_t index, HandleSlot* s, uint64_t st) noexcept {
+                uint64_t gen = ((st >> 32) + 1) & 0xFFFFFFFFull;
+                s->state.store((gen ? gen : 1) << 32, std::memory_order_release);
+                uint64_t head = free_.load(std::memory_order_relaxed);
+                do {
+                    s->next_free.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+                } while (!free_.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | index,
+                    std::memory_order_release, std::memory_order_relaxed));
+            }
+
+            uint32_t pop_free() noexcept {
+                uint64_t head = free_.load(std::memory_order_acquire);
+                for (;;) {
+                    uint32_t index = static_cast<uint32_t>(head);
+                    if (index == 0) {
+                        return 0;
+                    }
+                    uint32_t next = slot(index).next_free.load(std::memory_order_relaxed);
+                    if (free_.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | next,
+                        std::memory_order_acquire, std::memory_order_acquire)) {
+                        return index;
+                    }
+                }
+            }
+
+            std::atomic<HandleSlot*> chunks_[kMaxChunks] = {};
+            std::atomic<uint32_t> next_index_{ 1 };   // 0 is the null handle
+            std::atomic<uint64_t> free_{ 0 };
+            std::atomic<size_t> live_{ 0 };
+        };
+
+        template<typename T>
+        uint64_t make_handle_from_block(ControlBlock<T>* ctrl, T* object, HandleKind kind) {
+            static_assert(!is_ref_counted<T>::value, "RefCounted objects have no control block to hand out");
+            if (!ctrl) {
+                return 0;
+            }
+            if (kind == HandleKind::Weak) {
+                ctrl->add_weak();
+            }
+            else {
+                ctrl->add_strong();
+            }
+            uint64_t h = HandleTable::instance().create(ctrl,
+                const_cast<void*>(static_cast<const volatile void*>(object)), handle_ops<ControlBlock<T>>(), kind);
+            if (!h) {
+                if (kind == HandleKind::Weak) {
+                    ctrl->release_weak();
+                }
+                else {
+                    ctrl->release_strong();
+                }
+            }
+            return h;
+        }
+    }
+
+    // Handles are plain 64-bit values (gc_handle_t in C) naming a slot of a
+    // process-wide table, so C code and C++ code can pass objects to each
+    // other without copying them. A handle is looked up in O(1) without
+    // locks; a freed handle's slot gets a new generation, so stale copies
+    // look up as nothing instead of as someone else's object. 0 is never a
+    // valid handle.
+
+    // New handle on the object `p` owns; 0 if `p` is empty or weak (or the
+    // table is full).
+    template<typename T>
+    uint64_t make_handle(const Ptr<T>& p, HandleKind kind = HandleKind::Strong) {
+        return detail::make_handle_from_block<T>(detail::PtrAccess::strong_ctrl(p), p.get(), kind);
+    }
+
+    template<typename T>
+    uint64_t make_handle(const Ptr<T[]>& p, HandleKind kind = HandleKind::Strong) {
+        return make_handle(detail::PtrAccess::elements(p), kind);
+    }
+
+    // Strong Ptr to the handle's object; empty if the handle is stale or
+    // the object is gone. T must be the type (or element type) the handle
+    // was made from.
+    template<typename T>
+    Ptr<T> handle_ptr(uint64_t handle) {
+        auto& table = detail::HandleTable::instance();
+        detail::HandleSlot* s = table.enter(handle);
+        if (!s) {
+            return Ptr<T>();
+        }
+        assert(s->ops == detail::handle_ops<ControlBlock<T>>() && "handle_ptr<T> with the wrong counter layout");
+        auto* ctrl = static_cast<ControlBlock<T>*>(s->ctrl);
+        T* object = static_cast<T*>(s->object.load(std::memory_order_relaxed));
+        bool locked = s->ops->try_add_strong(ctrl);
+        table.leave(static_cast<uint32_t>(handle), s);
+        return locked ? detail::PtrAccess::adopt<T>(ctrl, object) : Ptr<T>();
+    }
+
+    // Drops the handle's reference. Pins taken through it stay valid until
+    // unpinned. False for stale handles.
+    inline bool free_handle(uint64_t handle) noexcept {
+        return detail::HandleTable::instance().destroy(handle);
+    }
+
+    // Handles not freed yet.
+    inline size_t live_handles() noexcept {
+        return detail::HandleTable::instance().live();
+    }
+
+}
@@ -0,0 +1,297 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Cpp_Ptr.hpp"
+
+namespace GC {
+
+    namespace detail {
+
+        // One published hazard. Records are shared by all threads, claimed
+        // one at a time and never freed.
+        struct alignas(64) HazardRecord {
+            std::atomic<const void*> hazard{ nullptr };
+            std::atomic<bool> in_use{ true };
+            HazardRecord* next = nullptr;
+        };
+
+        struct HazardThreadCache {
+            std::vector<HazardRecord*> free_records;
+            std::vector<RetiredRef> retired;
+
+            ~HazardThreadCache();
+        };
+
+        inline thread_local HazardThreadCache hazard_thread_cache;
+    }
+
+    // Hazard-pointer reclamation. A reader publishes the control block it is
+    // about to use instead of incrementing its strong count; a writer that
+    // unlinks a node with replace()/retire() only drops its strong reference
+    // once no hazard names that block. Unlike EpochDomain the backlog is
+    // bounded: at most kScanThreshold + hazards in use entries per thread.
+    class HazardDomain {
+    public:
+        static constexpr size_t kScanThreshold = 64;
+
+        HazardDomain(const HazardDomain&) = delete;
+        HazardDomain& operator=(const HazardDomain&) = delete;
+
+        static HazardDomain& global() {
+            static HazardDomain* domain = new HazardDomain();
+            return *domain;
+        }
+
+        // Defers dropping the strong reference held by `p`.
+        template<typename T>
+        void retire(Ptr<T> p) {
+            if (!p || p.is_weak()) {
+                return;
+            }
+            retire_block<T>(detail::PtrAccess::detach(p));
+        }
+
+        // Publishes `value` in `slot` with a single atomic exchange and
+        // retires the previous target. Meanwhile other threads may only read
+        // `slot` through protect(); copying, casting or resetting it races
+        // with the update.
+        template<typename T>
+        void replace(Ptr<T>& slot, Ptr<T> value) {
+            ControlBlock<T>* old = detail::PtrAccess::exchange(slot, std::move(value));
+            if (old) {
+                retire_block<T>(old);
+            }
+        }
+
+        // Releases every retired reference of this thread (and of exited
+        // threads) that no hazard currently protects.
+        void scan() {
+            // Pairs with the fence in protect(): either the reader sees the
+            // slot already replaced, or this scan sees its hazard.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::vector<const void*> hazards;
+            for (detail::HazardRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+                const void* h = r->hazard.load(std::memory_order_acquire);
+                if (h) {
+                    hazards.push_back(h);
+                }
+            }
+            std::sort(hazards.begin(), hazards.end());
+
+            std::vector<detail::RetiredRef> candidates;
+            candidates.swap(detail::hazard_thread_cache.retired);
+            {
+                std::unique_lock<std::mutex> lock(orphan_mtx_, std::try_to_lock);
+                if (lock.owns_lock()) {
+                    candidates.insert(candidates.end(), orphans_.begin(), orphans_.end());
+                    orphans_.clear();
+                }
+            }
+
+            // Releasing may retire more, so survivors are put back first.
+            std::vector<detail::RetiredRef> ready;
+            for (const auto& r : candidates) {
+                if (std::binary_search(hazards.begin(), hazards.end(), static_cast<const void*>(r.ctrl))) {
+                    detail::hazard_thread_cache.retired.push_back(r);
+                }
+                else {
+                    ready.push_back(r);
+                }
+            }
+            for (const auto& r : ready) {
+                r.release(r.ctrl);
+            }
+        }
+
+        // Retired by this thread and not released yet.
+        size_t pending() const noexcept {
+            return detail::hazard_thread_cache.retired.size();
+        }
+
+    private:
+        template<typename T> friend class Protected;
+        template<typename, typename> friend class Ptr;
+        friend struct detail::HazardThreadCache;
+
+        HazardDomain() = default;
+
+        template<typename T>
+        void retire_block(ControlBlock<T>* ctrl) {
+            auto& retired = detail::hazard_thread_cache.retired;
+            retired.push_back(detail::RetiredRef{ ctrl, &detail::release_retired<T>, 0 });
+            if (retired.size() >= kScanThreshold) {
+                scan();
+            }
+        }
+
+        detail::HazardRecord* acquire_record() {
+            auto& cache = detail::hazard_thread_cache.free_records;
+            if (!cache.empty()) {
+                detail::HazardRecord* r = cache.back();
+                cache.pop_back();
+                return r;
+            }
+            for (detail::HazardRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+                bool free = false;
+                if (!r->in_use.load(std::memory_order_relaxed) &&
+                    r->in_use.compare_exchange_strong(free, true, std::memory_order_acquire)) {
+                    return r;
+                }
+            }
+            auto* rec = new detail::HazardRecord();
+            rec->next = records_.load(std::memory_order_relaxed);
+            while (!records_.compare_exchange_weak(rec->next, rec,
+                std::memory_order_release, std::memory_order_relaxed)) {
+            }
+            return rec;
+        }
+
+        void release_record(detail::HazardRecord* rec) {
+            rec->hazard.store(nullptr, std::memory_order_release);
+            detail::hazard_thread_cache.free_records.push_back(rec);
+        }
+
+        void thread_exit(detail::HazardThreadCache& cache) {
+            for (detail::HazardRecord* r : cache.free_records) {
+                r->in_use.store(false, std::memory_order_release);
+            }
+            cache.free_records.clear();
+            if (!cache.retired.empty()) {
+                std::lock_guard<std::mutex> lock(orphan_mtx_);
+                orphans_.insert(orphans_.end(), cache.retired.begin(), cache.retired.end());
+                cache.retired.clear();
+            }
+        }
+
+        std::atomic<detail::HazardRecord*> records_{ nullptr };
+        std::mutex orphan_mtx_;
+        std::vector<detail::RetiredRef> orphans_;
+    };
+
+    // A hazard-protected view of a Ptr slot. The target stays alive while the
+    // Protected exists, as long as writers only unlink it via HazardDomain.
+    template<typename T>
+    class Protected {
+    public:
+        Protected() noexcept : ctrl_(nullptr), ptr_(nullptr), record_(nullptr) {}
+
+        Protected(Protected&& other) noexcept : ctrl_(other.ctrl_), ptr_(other.ptr_), record_(other.record_) {
+            other.ctrl_ = nullptr;
+            other.ptr_ = nullptr;
+            other.record_ = nullptr;
+        }
+
+        Protected& operator=(Protected&& other) noexcept {
+            if (this != &other) {
+                reset();
+                ctrl_ = other.ctrl_;
+                ptr_ = other.ptr_;
+                record_ = other.record_;
+                other.ctrl_ = nullptr;
+                other.ptr_ = nullptr;
+                other.record_ = nullptr;
+            }
+            return *this;
+        }
+
+        Protected(const Protected&) = delete;
+        Protected& operator=(const Protected&) = delete;
+
+        ~Protected() {
+            reset();
+        }
+
+        T* get() const noexcept {
+            return ptr_;
+        }
+
+        T& operator*() const noexcept {
+            assert(ptr_ && "Dereferencing null");
+            return *ptr_;
+        }
+
+        T* operator->() const noexcept {
+            assert(ptr_ && "Accessing through null");
+            return ptr_;
+        }
+
+        explicit operator bool() const noexcept {
+            return get() != nullptr;
+        }
+
+        // Promotes to an owning Ptr (one strong increment).
+        Ptr<T> lock() const {
+            if (ctrl_ && ctrl_->try_add_strong()) {
+                return detail::PtrAccess::adopt<T>(ctrl_, ptr_);
+            }
+            return Ptr<T>();
+        }
+
+        void reset() noexcept {
+            if (record_) {
+                HazardDomain::global().release_record(record_);
+            }
+            ctrl_ = nullptr;
+            ptr_ = nullptr;
+            record_ = nullptr;
+        }
+
+    private:
+        friend class Ptr<T>;
+
+        Protected(ControlBlock<T>* ctrl, T* ptr, detail::HazardRecord* record) noexcept
+            : ctrl_(ctrl), ptr_(ptr), record_(record) {
+        }
+
+        ControlBlock<T>* ctrl_;
+        T* ptr_;
+        detail::HazardRecord* record_;
+    };
+
+    template<typename T, typename E>
+    Protected<T> Ptr<T, E>::protect() const {
+        assert(!is_weak() && "protect() needs a strong slot");
+        detail::HazardRecord* rec = HazardDomain::global().acquire_record();
+        ControlBlock<T>* ctrl;
+        T* ptr;
+        for (;;) {
+            ctrl = ctrl_.load(std::memory_order_acquire);
+            if (ctrl == detail::slot_busy<T>()) {
+                std::this_thread::yield();
+                continue;
+            }
+            rec->hazard.store(ctrl, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ctrl_.load(std::memory_order_seq_cst) != ctrl) {
+                continue;
+            }
+            // The object pointer only changes while the slot is marked busy,
+            // so an unchanged block pointer around this load makes a pair.
+            ptr = ptr_.load(std::memory_order_acquire);
+            if (ctrl_.load(std::memory_order_acquire) == ctrl) {
+                break;
+            }
+        }
+        if (!ctrl) {
+            HazardDomain::global().release_record(rec);
+            return Protected<T>();
+        }
+        return Protected<T>(ctrl, ptr, rec);
+    }
+
+    namespace detail {
+
+        inline HazardThreadCache::~HazardThreadCache() {
+            HazardDomain::global().thread_exit(*this);
+        }
+    }
+
+}
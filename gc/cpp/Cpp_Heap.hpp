@@ -0,0 +1,777 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "Cpp_Numa.hpp"
+#include "Cpp_Stats.hpp"
+
+namespace GC {
+
+    namespace detail {
+
+        class ThreadHeap;
+
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // Header at the start of every page. Only the owning heap touches
+        // the local part; other threads only push onto `remote_free`, which
+        // sits on its own cache line.
+        struct alignas(64) HeapPage {
+            static constexpr size_t kSize = 64 * 1024;
+
+            std::atomic<ThreadHeap*> owner;
+            size_t size_class;
+            size_t block_size;
+            int node;
+            FreeBlock* local_free = nullptr;
+            char* bump;
+            char* end;
+            size_t used = 0;   // blocks not back on local_free
+
+            // Only while the page sits in EmptyPages.
+            HeapPage* next_empty = nullptr;
+            uint64_t empty_since = 0;
+            int purged = 0;    // 0 resident, 1 MADV_FREE, 2 MADV_DONTNEED
+
+            alignas(64) std::atomic<FreeBlock*> remote_free{ nullptr };
+
+            HeapPage(ThreadHeap* heap, size_t cls, size_t bytes, int numa_node) noexcept
+                : owner(heap), size_class(cls), block_size(bytes), node(numa_node),
+                bump(reinterpret_cast<char*>(this) + sizeof(HeapPage)),
+                end(reinterpret_cast<char*>(this) + kSize) {
+            }
+
+            static HeapPage* of(const void* p) noexcept {
+                return reinterpret_cast<HeapPage*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(kSize - 1));
+            }
+
+            void* take() noexcept {
+                if (FreeBlock* b = local_free) {
+                    local_free = b->next;
+                    ++used;
+                    return b;
+                }
+                if (bump + block_size <= end) {
+                    void* p = bump;
+                    bump += block_size;
+                    ++used;
+                    return p;
+                }
+                return nullptr;
+            }
+
+            void give_back(void* p) noexcept {
+                auto* b = static_cast<FreeBlock*>(p);
+                b->next = local_free;
+                local_free = b;
+                --used;
+            }
+
+            // Lock-free push from a thread that does not own the page.
+            void push_remote(void* p) noexcept {
+                auto* b = static_cast<FreeBlock*>(p);
+                FreeBlock* head = remote_free.load(std::memory_order_relaxed);
+                do {
+                    b->next = head;
+                } while (!remote_free.compare_exchange_weak(head, b,
+                    std::memory_order_release, std::memory_order_relaxed));
+            }
+
+            // Moves every remotely freed block to the local list in one
+            // exchange. Owner only.
+            size_t collect_remote() noexcept {
+                FreeBlock* b = remote_free.exchange(nullptr, std::memory_order_acquire);
+                size_t n = 0;
+                while (b) {
+                    FreeBlock* next = b->next;
+                    give_back(b);
+                    b = next;
+                    ++n;
+                }
+                return n;
+            }
+
+            bool has_room() const noexcept {
+                return local_free || bump + block_size <= end ||
+                    remote_free.load(std::memory_order_relaxed) != nullptr;
+            }
+        };
+
+        // Pages of heaps whose threads have exited, still holding live
+        // blocks. Frees to them pile up on their remote lists until another
+        // heap adopts them.
+        struct AbandonedPages {
+            std::mutex mtx;
+            std::vector<HeapPage*> pages;
+
+            static AbandonedPages& instance() {
+                static AbandonedPages* a = new AbandonedPages();
+                return *a;
+            }
+        };
+
+        // How long a page stays empty before its blocks go back to the OS;
+        // negative keeps them.
+        inline std::atomic<int64_t> heap_decay_ms{ 1000 };
+
+        // Bytes the heap holds from the OS: pages minus what was discarded
+        // from them, plus blocks too large for a page and arena chunks.
+        inline std::atomic<size_t> heap_usage_bytes{ 0 };
+
+        // Bytes in live blocks. Thread heaps count locally and fold their
+        // count in every kLiveFlush bytes, so this lags by that much per
+        // thread.
+        inline std::atomic<int64_t> heap_live_bytes{ 0 };
+        constexpr int64_t kLiveFlush = 64 * 1024;
+
+        // Defined in Cpp_Pressure.hpp. Reacts when heap_usage_bytes has
+        // crossed a threshold of the heap limit.
+        void check_heap_pressure() noexcept;
+
+        // Part of a page after the OS page that holds its header.
+        inline size_t discardable_bytes() noexcept {
+#ifdef __linux__
+            static const size_t os_page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t header = (sizeof(HeapPage) + os_page - 1) / os_page * os_page;
+            return header < HeapPage::kSize ? HeapPage::kSize - header : 0;
+#else
+            return 0;
+#endif
+        }
+
+        // Hands the block area of an empty page back to the OS. Returns
+        // the bytes released.
+        inline size_t discard_blocks(HeapPage* page, bool eager) noexcept {
+#ifdef __linux__
+            size_t n = discardable_bytes();
+            if (n == 0) {
+                return 0;
+            }
+            void* mem = reinterpret_cast<char*>(page) + (HeapPage::kSize - n);
+#ifdef MADV_FREE
+            // Lazy: the kernel takes the pages only under memory pressure.
+            if (!eager && madvise(mem, n, MADV_FREE) == 0) {
+                return n;
+            }
+#endif
+            return madvise(mem, n, MADV_DONTNEED) == 0 ? n : 0;
+#else
+            (void)page;
+            (void)eager;
+            return 0;
+#endif
+        }
+
+        // Pages without a live block, shared by all heaps and reused for
+        // any size class. Pages that stay here past the decay interval have
+        // their blocks discarded lazily, past twice the interval for good;
+        // the page itself is kept for reuse.
+        class EmptyPages {
+        public:
+            static EmptyPages& instance() {
+                static EmptyPages* e = new EmptyPages();
+                return *e;
+            }
+
+            void put(HeapPage* page, uint64_t now) noexcept {
+                std::lock_guard<std::mutex> lock(mtx_);
+                page->owner.store(nullptr, std::memory_order_relaxed);
+                page->empty_since = now;
+                page->purged = 0;
+                page->next_empty = head_;
+                head_ = page;
+            }
+
+            // Most recently emptied page of `node`, or null.
+            HeapPage* take(int node) noexcept {
+                std::lock_guard<std::mutex> lock(mtx_);
+                for (HeapPage** link = &head_; *link; link = &(*link)->next_empty) {
+                    HeapPage* page = *link;
+                    if (page->node == node) {
+                        *link = page->next_empty;
+                        return page;
+                    }
+                }
+                return nullptr;
+            }
+
+            // Discards pages empty since before `eager_cutoff` with
+            // MADV_DONTNEED and those since before `lazy_cutoff` with
+            // MADV_FREE; returns the bytes released.
+            size_t purge(uint64_t lazy_cutoff, uint64_t eager_cutoff) noexcept {
+                size_t released = 0;
+                std::lock_guard<std::mutex> lock(mtx_);
+                for (HeapPage* page = head_; page; page = page->next_empty) {
+                    int level = page->empty_since <= eager_cutoff ? 2 : page->empty_since <= lazy_cutoff ? 1 : 0;
+                    if (page->purged < level) {
+                        size_t n = discard_blocks(page, level == 2);
+                        if (n) {
+                            if (page->purged == 0) {
+                                heap_usage_bytes.fetch_sub(n, std::memory_order_relaxed);
+                            }
+                            released += n;
+                            page->purged = level;
+                        }
+                    }
+                }
+                return released;
+            }
+
+            // Frees every page outright; returns the bytes that were still
+            // resident.
+            size_t release_all() noexcept {
+                HeapPage* page;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    page = head_;
+                    head_ = nullptr;
+                }
+                size_t released = 0;
+                while (page) {
+                    HeapPage* next = page->next_empty;
+                    size_t resident = HeapPage::kSize - (page->purged == 2 ? discardable_bytes() : 0);
+                    heap_usage_bytes.fetch_sub(HeapPage::kSize - (page->purged ? discardable_bytes() : 0),
+                        std::memory_order_relaxed);
+                    released += resident;
+                    page->~HeapPage();
+                    ::operator delete(static_cast<void*>(page), std::align_val_t(HeapPage::kSize));
+                    page = next;
+                }
+                return released;
+            }
+
+            // Lets the first caller through once every half decay interval.
+            bool due(uint64_t now, int64_t decay_ms) noexcept {
+                uint64_t next = next_decay_.load(std::memory_order_relaxed);
+                uint64_t step = static_cast<uint64_t>(decay_ms > 1 ? decay_ms : 1) * 500000;
+                return now >= next &&
+                    next_decay_.compare_exchange_strong(next, now + step, std::memory_order_relaxed);
+            }
+
+            void rearm() noexcept {
+                next_decay_.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            std::mutex mtx_;
+            HeapPage* head_ = nullptr;
+            std::atomic<uint64_t> next_decay_{ 0 };
+        };
+
+        // Moves abandoned pages that other threads have since emptied into
+        // EmptyPages.
+        inline void reclaim_abandoned(uint64_t now) noexcept {
+            AbandonedPages& a = AbandonedPages::instance();
+            std::lock_guard<std::mutex> lock(a.mtx);
+            auto keep = a.pages.begin();
+            for (HeapPage* page : a.pages) {
+                page->collect_remote();
+                if (page->used == 0) {
+                    EmptyPages::instance().put(page, now);
+                }
+                else {
+                    *keep++ = page;
+                }
+            }
+            a.pages.erase(keep, a.pages.end());
+        }
+
+        // Discards pages that have been empty for the decay interval. Runs
+        // at most once per half interval, from whichever thread gets here.
+        inline void decay_heap() noexcept {
+            int64_t decay = heap_decay_ms.load(std::memory_order_relaxed);
+            uint64_t now = now_ns();
+            if (decay < 0 || !EmptyPages::instance().due(now, decay)) {
+                return;
+            }
+            reclaim_abandoned(now);
+            uint64_t age = static_cast<uint64_t>(decay) * 1000000;
+            EmptyPages::instance().purge(now > age ? now - age : 0, now > 2 * age ? now - 2 * age : 0);
+        }
+
+        // Per-thread small-object heap: size classes of 16 bytes up to
+        // kMaxSmall, each served from 64 KiB pages owned by this heap and
+        // placed on one NUMA node. A block freed by its owner goes straight
+        // back on the page; one freed elsewhere is pushed onto the page's
+        // remote list and picked up by the owner when the page runs dry.
+        class ThreadHeap {
+        public:
+            static constexpr size_t kGranule = 16;
+            static constexpr size_t kMaxSmall = 512;
+            static constexpr size_t kClasses = kMaxSmall / kGranule;
+
+            ThreadHeap() : home_node_(NumaTopology::instance().current_node()) {}
+            ThreadHeap(const ThreadHeap&) = delete;
+            ThreadHeap& operator=(const ThreadHeap&) = delete;
+
+            static size_t class_of(size_t bytes) noexcept {
+                return bytes == 0 ? 0 : (bytes - 1) / kGranule;
+            }
+
+            // `node` < 0 means the node this thread runs on.
+            void* allocate(size_t cls, int node) {
+                size_t n = static_cast<size_t>(node < 0 ? home_node_ : node);
+                if (n < bins_.size()) {
+                    if (HeapPage* page = bins_[n].current[cls]) {
+                        if (void* p = page->take()) {
+                            count_live(static_cast<int64_t>(page->block_size));
+                            return p;
+                        }
+                    }
+                }
+                void* p = allocate_slow(cls, node);
+                count_live(static_cast<int64_t>((cls + 1) * kGranule));
+                return p;
+            }
+
+            void count_live(int64_t bytes) noexcept {
+                live_delta_ += bytes;
+                if (live_delta_ >= kLiveFlush || live_delta_ <= -kLiveFlush) {
+                    flush_live();
+                }
+            }
+
+            void flush_live() noexcept {
+                heap_live_bytes.fetch_add(live_delta_, std::memory_order_relaxed);
+                live_delta_ = 0;
+            }
+
+            // Called by the owner when `page` has just lost its last block. The
+            // page being allocated from stays; any other goes to EmptyPages.
+            void page_emptied(HeapPage* page) noexcept {
+                Bins& bins = bins_[static_cast<size_t>(page->node)];
+                if (bins.current[page->size_class] == page) {
+                    return;
+                }
+                std::vector<HeapPage*>& list = bins.pages[page->size_class];
+                list.erase(std::find(list.begin(), list.end(), page));
+                EmptyPages::instance().put(page, now_ns());
+                decay_heap();
+            }
+
+            // Hands every empty page of this heap, including the ones being
+            // allocated from, to EmptyPages.
+            void release_empty() noexcept {
+                uint64_t now = now_ns();
+                for (auto& bins : bins_) {
+                    for (size_t cls = 0; cls < kClasses; ++cls) {
+                        std::vector<HeapPage*>& list = bins.pages[cls];
+                        auto keep = list.begin();
+                        for (HeapPage* page : list) {
+                            page->collect_remote();
+                            if (page->used == 0) {
+                                if (bins.current[cls] == page) {
+                                    bins.current[cls] = nullptr;
+                                }
+                                EmptyPages::instance().put(page, now);
+                            }
+                            else {
+                                *keep++ = page;
+                            }
+                        }
+                        list.erase(keep, list.end());
+                    }
+                }
+            }
+
+            // Empty pages go to EmptyPages, the rest to AbandonedPages.
+            ~ThreadHeap() {
+                flush_live();
+                for (auto& bins : bins_) {
+                    for (auto& list : bins.pages) {
+                        abandon(list);
+                    }
+                }
+            }
+
+        private:
+            struct Bins {
+                HeapPage* current[kClasses] = {};
+                std::vector<HeapPage*> pages[kClasses];
+            };
+
+            static void abandon(std::vector<HeapPage*>& list) {
+                for (HeapPage* page : list) {
+                    page->collect_remote();
+                    if (page->used == 0) {
+                        EmptyPages::instance().put(page, now_ns());
+                    }
+                    else {
+                        page->owner.store(nullptr, std::memory_order_release);
+                        AbandonedPages& a = AbandonedPages::instance();
+                        std::lock_guard<std::mutex> lock(a.mtx);
+                        a.pages.push_back(page);
+                    }
+                }
+            }
+
+            void* allocate_slow(size_t cls, int node) {
+                NumaTopology& topology = NumaTopology::instance();
+                int count = topology.node_count();
+                if (node < 0 || node >= count) {
+                    // Threads migrate; follow them when a page runs dry.
+                    home_node_ = topology.current_node();
+                    node = home_node_ < count ? home_node_ : 0;
+                }
+                if (bins_.size() <= static_cast<size_t>(node)) {
+                    bins_.resize(static_cast<size_t>(node) + 1);
+                }
+                HeapPage** current = bins_[static_cast<size_t>(node)].current;
+                std::vector<HeapPage*>& list = bins_[static_cast<size_t>(node)].pages[cls];
+                retire_remote_emptied(list, current[cls]);
+                if (HeapPage* page = current[cls]) {
+                    page->collect_remote();
+                    if (void* p = page->take()) {
+                        return p;
+                    }
+                }
+                for (HeapPage* page : list) {
+                    if (page != current[cls] && page->has_room()) {
+                        page->collect_remote();
+                        if (void* p = page->take()) {
+                            current[cls] = page;
+                            return p;
+                        }
+                    }
+                }
+                HeapPage* page = adopt(cls, node);
+                if (!page) {
+                    decay_heap();
+                    page = EmptyPages::instance().take(node);
+                    if (page) {
+                        if (page->purged) {
+                            heap_usage_bytes.fetch_add(discardable_bytes(), std::memory_order_relaxed);
+                        }
+                        page->~HeapPage();
+                        page = ::new (static_cast<void*>(page)) HeapPage(this, cls, (cls + 1) * kGranule, node);
+                    }
+                }
+                if (!page) {
+                    void* mem = ::operator new(HeapPage::kSize, std::align_val_t(HeapPage::kSize));
+                    topology.bind(mem, HeapPage::kSize, node);
+                    page = ::new (mem) HeapPage(this, cls, (cls + 1) * kGranule, node);
+                    heap_usage_bytes.fetch_add(HeapPage::kSize, std::memory_order_relaxed);
+                }
+                list.push_back(page);
+                current[cls] = page;
+                void* p = page->take();
+                // Last: a pressure callback may allocate from this heap.
+                check_heap_pressure();
+                return p;
+            }
+
+            // Pages whose last blocks were freed by other threads are only
+            // seen to be empty once their remote lists are drained. Doing
+            // that whenever a page runs dry retires them the same way as
+            // pages emptied locally, so producer/consumer heaps decay too.
+            void retire_remote_emptied(std::vector<HeapPage*>& list, HeapPage* current) noexcept {
+                for (size_t i = 0; i < list.size();) {
+                    HeapPage* page = list[i];
+                    if (page != current && page->remote_free.load(std::memory_order_relaxed)) {
+                        page->collect_remote();
+                        if (page->used == 0) {
+                            page_emptied(page);   // erases list[i]
+                            continue;
+                        }
+                    }
+                    ++i;
+                }
+            }
+
+            // Takes over an abandoned page of this class and node that has
+            // room.
+            HeapPage* adopt(size_t cls, int node) {
+                AbandonedPages& a = AbandonedPages::instance();
+                std::lock_guard<std::mutex> lock(a.mtx);
+                for (auto it = a.pages.begin(); it != a.pages.end(); ++it) {
+                    HeapPage* page = *it;
+                    if (page->size_class == cls && page->node == node && page->has_room()) {
+                        a.pages.erase(it);
+                        page->owner.store(this, std::memory_order_release);
+                        page->collect_remote();
+                        return page;
+                    }
+                }
+                return nullptr;
+            }
+
+            int home_node_;
+            std::vector<Bins> bins_;
+            int64_t live_delta_ = 0;
+        };
+
+        // This thread's heap. Once it is torn down (thread exit), late
+        // allocations from this thread go to a shared heap under a lock.
+        // Plain variables rather than members of HeapHandle: stores made in
+        // a destructor to the object being destroyed may be optimized out.
+        inline thread_local ThreadHeap* thread_heap = nullptr;
+        inline thread_local bool thread_heap_dead = false;
+
+        struct HeapHandle {
+            ~HeapHandle() {
+                delete thread_heap;
+                thread_heap = nullptr;
+                thread_heap_dead = true;
+            }
+        };
+
+        inline thread_local HeapHandle heap_handle;
+
+        struct SharedHeap {
+            std::mutex mtx;
+            ThreadHeap heap;
+
+            static SharedHeap& instance() {
+                static SharedHeap* s = new SharedHeap();
+                return *s;
+            }
+        };
+
+        inline bool heap_serves(size_t bytes, size_t align) noexcept {
+            return bytes <= ThreadHeap::kMaxSmall && align <= ThreadHeap::kGranule;
+        }
+
+        // Set while pressure callbacks must not run on this thread.
+        inline thread_local int pressure_blocked = 0;
+
+        struct PressureBlock {
+            PressureBlock() noexcept { ++pressure_blocked; }
+            ~PressureBlock() { --pressure_blocked; }
+            PressureBlock(const PressureBlock&) = delete;
+            PressureBlock& operator=(const PressureBlock&) = delete;
+        };
+
+        // Safepoint poll of the allocation path (see Cpp_Safepoint.hpp):
+        // non-zero while some attached thread owes a handshake action;
+        // poll_handler runs this thread's share. Every New path polls
+        // first, before it has taken any heap state, so actions (and the
+        // destructors flush_counts may run) can allocate themselves.
+        inline std::atomic<int> handshakes_pending{ 0 };
+        inline thread_local void (*poll_handler)() = nullptr;
+
+        inline void safepoint_poll() {
+            if (handshakes_pending.load(std::memory_order_relaxed) != 0) {
+                if (void (*handler)() = poll_handler) {
+                    handler();
+                }
+            }
+        }
+
+        // Memory GC objects get from operator new rather than from pages
+        // (large blocks, arena chunks) counts as both usage and live bytes,
+        // so the heap limit and the pacer see it.
+        inline void count_outside_bytes(size_t bytes) noexcept {
+            heap_usage_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            heap_live_bytes.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+            check_heap_pressure();
+        }
+
+        inline void uncount_outside_bytes(size_t bytes) noexcept {
+            heap_usage_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+            heap_live_bytes.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+        }
+
+        inline void* heap_allocate(size_t bytes, size_t align) {
+            safepoint_poll();
+            if (!heap_serves(bytes, align)) {
+                void* p = align > __STDCPP_DEFAULT_NEW_ALIGNMENT__
+                    ? ::operator new(bytes, std::align_val_t(align))
+                    : ::operator new(bytes);
+                count_outside_bytes(bytes);
+                return p;
+            }
+            if (!thread_heap && !thread_heap_dead) {
+                (void)&heap_handle;   // registers the teardown
+                thread_heap = new ThreadHeap();
+            }
+            if (ThreadHeap* heap = thread_heap) {
+                return heap->allocate(ThreadHeap::class_of(bytes), target_node);
+            }
+            SharedHeap& s = SharedHeap::instance();
+            std::lock_guard<std::mutex> lock(s.mtx);
+            PressureBlock block;
+            return s.heap.allocate(ThreadHeap::class_of(bytes), target_node);
+        }
+
+        inline void heap_free(void* p, size_t bytes, size_t align) noexcept {
+            if (!heap_serves(bytes, align)) {
+                uncount_outside_bytes(bytes);
+                if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+                    ::operator delete(p, std::align_val_t(align));
+                }
+                else {
+                    ::operator delete(p);
+                }
+                return;
+            }
+            HeapPage* page = HeapPage::of(p);
+            ThreadHeap* mine = thread_heap;
+            // Any thread may count the free; only the sum matters.
+            if (mine) {
+                mine->count_live(-static_cast<int64_t>(page->block_size));
+            }
+            else {
+                heap_live_bytes.fetch_sub(static_cast<int64_t>(page->block_size), std::memory_order_relaxed);
+            }
+            if (mine && page->owner.load(std::memory_order_relaxed) == mine) {
+                page->give_back(p);
+                if (page->used == 0) {
+                    mine->page_emptied(page);
+                }
+            }
+            else {
+                page->push_remote(p);
+            }
+        }
+    }
+
+    // Allocator backed by the per-thread heaps; what GC::New uses for its
+    // blocks. Small blocks freed on another thread are returned to the
+    // owning thread's page without locks. Larger or over-aligned requests
+    // go to operator new.
+    template<typename T>
+    class PoolAllocator {
+    public:
+        using value_type = T;
+
+        PoolAllocator() noexcept = default;
+
+        template<typename U>
+        PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+        T* allocate(size_t n) {
+            if (n > static_cast<size_t>(-1) / sizeof(T)) {
+                throw std::bad_array_new_length();
+            }
+            return static_cast<T*>(detail::heap_allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T* p, size_t n) noexcept {
+            detail::heap_free(p, n * sizeof(T), alignof(T));
+        }
+
+        template<typename U>
+        bool operator==(const PoolAllocator<U>&) const noexcept {
+            return true;
+        }
+
+        template<typename U>
+        bool operator!=(const PoolAllocator<U>&) const noexcept {
+            return false;
+        }
+    };
+
+    namespace detail {
+
+        // Background decay for processes whose threads go quiet after a
+        // burst: without allocator activity nothing else would run it.
+        class HeapPurger {
+        public:
+            ~HeapPurger() { stop(); }
+
+            void start(std::chrono::milliseconds interval) {
+                stop();
+                std::lock_guard<std::mutex> lock(mtx_);
+                stopping_ = false;
+                worker_ = std::thread([this, interval] {
+                    std::unique_lock<std::mutex> guard(mtx_);
+                    while (!cv_.wait_for(guard, interval, [this] { return stopping_; })) {
+                        decay_heap();
+                    }
+                });
+            }
+
+            void stop() {
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    stopping_ = true;
+                }
+                cv_.notify_all();
+                if (worker_.joinable()) {
+                    worker_.join();
+                }
+            }
+
+        private:
+            std::mutex mtx_;
+            std::condition_variable cv_;
+            std::thread worker_;
+            bool stopping_ = false;
+        };
+
+        inline HeapPurger& heap_purger() {
+            static HeapPurger purger;
+            return purger;
+        }
+    }
+
+    // Bytes the GC heap holds from the OS right now: pages, large blocks
+    // and arena chunks. RefCounted objects come from plain new and are not
+    // counted.
+    inline size_t heap_usage() noexcept {
+        return detail::heap_usage_bytes.load(std::memory_order_relaxed);
+    }
+
+    // Bytes in live GC blocks, to within 64 KiB per thread.
+    inline size_t heap_live() noexcept {
+        int64_t live = detail::heap_live_bytes.load(std::memory_order_relaxed);
+        return live > 0 ? static_cast<size_t>(live) : 0;
+    }
+
+    // Heap pages that have been empty for `decay` give their memory back to
+    // the OS lazily (MADV_FREE: reclaimed under pressure), and for good
+    // (MADV_DONTNEED) after twice that. The check runs when pages empty or
+    // run out, and from the heap purger if started. Negative disables it;
+    // the default is one second.
+    inline void set_heap_decay(std::chrono::milliseconds decay) noexcept {
+        detail::heap_decay_ms.store(static_cast<int64_t>(decay.count()), std::memory_order_relaxed);
+        detail::EmptyPages::instance().rearm();
+    }
+
+    // Runs the decay check every `interval` on a background thread until
+    // stop_heap_purger() or program exit.
+    inline void start_heap_purger(std::chrono::milliseconds interval = std::chrono::milliseconds(500)) {
+        detail::heap_purger().start(interval);
+    }
+
+    inline void stop_heap_purger() {
+        detail::heap_purger().stop();
+    }
+
+    // Frees all empty heap pages now, whatever the decay, and asks malloc
+    // to hand its free memory back to the OS. Pages of other live threads
+    // are only seen once those threads have handed them over. Returns the
+    // resident bytes released from the GC heap.
+    inline size_t trim() {
+        if (detail::ThreadHeap* heap = detail::thread_heap) {
+            heap->release_empty();
+        }
+        detail::reclaim_abandoned(detail::now_ns());
+        size_t released = detail::EmptyPages::instance().release_all();
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+        return released;
+    }
+
+}
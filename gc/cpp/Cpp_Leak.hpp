@@ -0,0 +1,436 @@
+
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <type_traits>
+#include <typeinfo>
+
+#include "Cpp_Stats.hpp"
+
+#ifdef GC_LEAK_DETECTOR
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#endif
+
+namespace GC {
+
+    // Source location of a managed allocation (filled in by GC_NEW).
+    struct AllocSite {
+        const char* file;
+        int line;
+    };
+
+    namespace detail {
+        // Defined with GC_TRACE in Cpp_Ptr.hpp.
+        template<typename T, typename = void>
+        struct is_traceable_impl;
+    }
+
+#ifdef GC_LEAK_DETECTOR
+
+    namespace detail {
+
+        template<typename T>
+        const char* type_name() {
+            static const std::string name = [] {
+                const char* raw = typeid(T).name();
+#ifdef __GNUG__
+                int status = 0;
+                char* demangled = abi::__cxa_demangle(raw, nullptr, nullptr, &status);
+                if (status == 0 && demangled) {
+                    std::string out(demangled);
+                    std::free(demangled);
+                    return out;
+                }
+#endif
+                return std::string(raw);
+            }();
+            return name.c_str();
+        }
+
+        // Appends the address of every Ptr that `count` objects at `object`
+        // list in GC_TRACE, wherever it lives (a vector member's buffer).
+        template<typename T>
+        void leak_traced_slots(const void* object, size_t count, std::vector<const void*>& out) {
+            auto each = [&](const auto& ptr) { out.push_back(&ptr); };
+            const T* elems = static_cast<const T*>(object);
+            for (size_t i = 0; i < count; ++i) {
+                elems[i].gc_trace(each);
+            }
+        }
+
+        // Tracks every live managed object and every Ptr currently holding a
+        // strong reference. A strong Ptr is an edge of the object graph if a
+        // managed object lists it in GC_TRACE or it lies inside a managed
+        // object's bytes; any other strong Ptr (stack, globals, unmanaged
+        // heap) is a root. Without GC_TRACE, Ptrs in a member's own heap
+        // buffer (std::vector<GC::Ptr<T>>) therefore count as roots and
+        // cycles through them are not reported.
+        class LeakRegistry {
+        private:
+            using TracedSlots = void (*)(const void*, size_t, std::vector<const void*>&);
+
+            struct BlockInfo {
+                const void* object;
+                size_t size;
+                size_t count;
+                const char* type;
+                AllocSite site;
+                TracedSlots traced;
+            };
+
+            std::mutex mtx_;
+            std::unordered_map<const void*, BlockInfo> blocks_;
+            std::unordered_map<const void*, const void*> slots_;
+            bool report_at_exit_ = true;
+            bool incomplete_ = false;   // a table insert ran out of memory
+
+            LeakRegistry() {
+                std::atexit([] {
+                    LeakRegistry& reg = instance();
+                    bool enabled;
+                    {
+                        std::lock_guard<std::mutex> lock(reg.mtx_);
+                        enabled = reg.report_at_exit_;
+                    }
+                    if (enabled) {
+                        reg.report(std::cerr, true);
+                    }
+                });
+            }
+
+        public:
+            static LeakRegistry& instance() {
+                // Never destroyed: Ptrs in other static objects may outlive us.
+                static LeakRegistry* reg = new LeakRegistry();
+                return *reg;
+            }
+
+            // The hooks run inside noexcept Ptr operations, so a failed
+            // insert only marks the tables incomplete for the next report.
+            void on_block(const void* ctrl, const void* object, size_t size, size_t count,
+                const char* type, AllocSite site, TracedSlots traced) noexcept {
+                std::lock_guard<std::mutex> lock(mtx_);
+                try {
+                    blocks_[ctrl] = BlockInfo{ object, size, count, type, site, traced };
+                }
+                catch (...) {
+                    incomplete_ = true;
+                }
+            }
+
+            void on_object_destroyed(const void* ctrl) noexcept {
+                std::lock_guard<std::mutex> lock(mtx_);
+                blocks_.erase(ctrl);
+            }
+
+            void on_slot(const void* slot, const void* strong_ctrl) noexcept {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (strong_ctrl) {
+                    try {
+                        slots_[slot] = strong_ctrl;
+                    }
+                    catch (...) {
+                        // A lost root can make live objects look unreachable.
+                        slots_.erase(slot);
+                        incomplete_ = true;
+                    }
+                }
+                else {
+                    slots_.erase(slot);
+                }
+            }
+
+            void set_report_at_exit(bool enabled) {
+                std::lock_guard<std::mutex> lock(mtx_);
+                report_at_exit_ = enabled;
+            }
+
+            size_t report(std::ostream& os, bool quiet_if_clean = false);
+        };
+
+        inline size_t LeakRegistry::report(std::ostream& os, bool quiet_if_clean) {
+            PassTimer timer(Metric::CycleScanTime);
+            std::vector<const void*> ctrls;
+            std::vector<BlockInfo> infos;
+            std::vector<std::pair<const void*, const void*>> slots;
+            std::unordered_map<const void*, const void*> traced_owner;   // slot -> ctrl
+            bool incomplete;
+            {
+                // Objects are unregistered under the lock before they are
+                // destroyed, so tracing them here is safe from that; their
+                // Ptr members must not be changing meanwhile.
+                std::lock_guard<std::mutex> lock(mtx_);
+                std::vector<const void*> traced;
+                for (const auto& b : blocks_) {
+                    ctrls.push_back(b.first);
+                    infos.push_back(b.second);
+                    if (b.second.traced) {
+                        traced.clear();
+                        b.second.traced(b.second.object, b.second.count, traced);
+                        for (const void* slot : traced) {
+                            traced_owner[slot] = b.first;
+                        }
+                    }
+                }
+                slots.assign(slots_.begin(), slots_.end());
+                incomplete = incomplete_;
+            }
+
+            const size_t n = ctrls.size();
+            std::unordered_map<const void*, size_t> index;
+            for (size_t i = 0; i < n; ++i) {
+                index[ctrls[i]] = i;
+            }
+
+            // Objects ordered by address to find which object owns a slot.
+            std::vector<size_t> by_addr(n);
+            for (size_t i = 0; i < n; ++i) by_addr[i] = i;
+            std::sort(by_addr.begin(), by_addr.end(), [&](size_t a, size_t b) {
+                return infos[a].object < infos[b].object;
+            });
+
+            auto owner_of = [&](const void* slot) -> long {
+                auto it = std::upper_bound(by_addr.begin(), by_addr.end(), slot,
+                    [&](const void* s, size_t i) { return s < infos[i].object; });
+                if (it == by_addr.begin()) return -1;
+                size_t i = *(it - 1);
+                const char* begin = static_cast<const char*>(infos[i].object);
+                const char* p = static_cast<const char*>(slot);
+                return (p < begin + infos[i].size) ? static_cast<long>(i) : -1;
+            };
+
+            std::vector<std::vector<size_t>> edges(n);
+            std::vector<size_t> roots;
+            for (const auto& s : slots) {
+                auto target = index.find(s.second);
+                if (target == index.end()) continue;
+                auto traced = traced_owner.find(s.first);
+                long owner = traced != traced_owner.end()
+                    ? static_cast<long>(index[traced->second])
+                    : owner_of(s.first);
+                if (owner < 0) {
+                    roots.push_back(target->second);
+                }
+                else {
+                    edges[static_cast<size_t>(owner)].push_back(target->second);
+                }
+            }
+
+            std::vector<bool> reachable(n, false);
+            std::vector<size_t> stack(roots);
+            while (!stack.empty()) {
+                size_t v = stack.back();
+                stack.pop_back();
+                if (reachable[v]) continue;
+                reachable[v] = true;
+                for (size_t w : edges[v]) {
+                    if (!reachable[w]) stack.push_back(w);
+                }
+            }
+
+            // Tarjan's SCC over the unreachable subgraph (iterative).
+            const size_t unvisited = static_cast<size_t>(-1);
+            std::vector<size_t> order(n, unvisited), low(n, 0), comp(n, unvisited);
+            std::vector<bool> on_stack(n, false);
+            std::vector<size_t> scc_stack;
+            std::vector<std::vector<size_t>> sccs;
+            size_t counter = 0;
+
+            for (size_t start = 0; start < n; ++start) {
+                if (reachable[start] || order[start] != unvisited) continue;
+                std::vector<std::pair<size_t, size_t>> call{ { start, 0 } };
+                order[start] = low[start] = counter++;
+                scc_stack.push_back(start);
+                on_stack[start] = true;
+
+                while (!call.empty()) {
+                    size_t v = call.back().first;
+                    size_t& next = call.back().second;
+                    if (next < edges[v].size()) {
+                        size_t w = edges[v][next++];
+                        if (order[w] == unvisited) {
+                            order[w] = low[w] = counter++;
+                            scc_stack.push_back(w);
+                            on_stack[w] = true;
+                            call.push_back({ w, 0 });
+                        }
+                        else if (on_stack[w]) {
+                            low[v] = std::min(low[v], order[w]);
+                        }
+                        continue;
+                    }
+                    if (low[v] == order[v]) {
+                        std::vector<size_t> scc;
+                        size_t w;
+                        do {
+                            w = scc_stack.back();
+                            scc_stack.pop_back();
+                            on_stack[w] = false;
+                            comp[w] = sccs.size();
+                            scc.push_back(w);
+                        } while (w != v);
+                        sccs.push_back(std::move(scc));
+                    }
+                    call.pop_back();
+                    if (!call.empty()) {
+                        size_t parent = call.back().first;
+                        low[parent] = std::min(low[parent], low[v]);
+                    }
+                }
+            }
+
+            std::vector<size_t> cycles;
+            for (size_t c = 0; c < sccs.size(); ++c) {
+                const auto& scc = sccs[c];
+                bool self_loop = std::find(edges[scc[0]].begin(), edges[scc[0]].end(), scc[0])
+                    != edges[scc[0]].end();
+                if (scc.size() > 1 || self_loop) {
+                    cycles.push_back(c);
+                }
+            }
+
+            size_t leaked = 0;
+            std::map<std::tuple<std::string, std::string, int>, size_t> groups;
+            for (size_t i = 0; i < n; ++i) {
+                if (reachable[i]) continue;
+                ++leaked;
+                const BlockInfo& b = infos[i];
+                groups[std::make_tuple(std::string(b.type),
+                    std::string(b.site.file ? b.site.file : "<unknown>"), b.site.line)]++;
+            }
+
+            if (leaked == 0 && quiet_if_clean) {
+                return 0;
+            }
+
+            auto describe = [&](size_t i) {
+                const BlockInfo& b = infos[i];
+                os << b.type << " @" << b.object;
+                if (b.site.file) {
+                    os << " (" << b.site.file << ":" << b.site.line << ")";
+                }
+            };
+
+            os << "[GC leak report] " << leaked << " unreachable object(s), "
+                << cycles.size() << " strong cycle(s)\n";
+            if (incomplete) {
+                os << "  (tracking ran out of memory earlier; objects may be missing or wrongly listed)\n";
+            }
+            for (const auto& g : groups) {
+                os << "  " << g.second << " x " << std::get<0>(g.first);
+                if (std::get<2>(g.first) > 0) {
+                    os << " allocated at " << std::get<1>(g.first) << ":" << std::get<2>(g.first);
+                }
+                else {
+                    os << " allocated at " << std::get<1>(g.first);
+                }
+                os << "\n";
+            }
+
+            size_t number = 0;
+            for (size_t c : cycles) {
+                const auto& scc = sccs[c];
+                os << "  cycle #" << ++number << " (" << scc.size() << " object(s)):\n";
+
+                // Shortest path inside the component from its first member back to itself.
+                size_t head = scc[0];
+                std::unordered_map<size_t, size_t> parent;
+                std::vector<size_t> frontier{ head };
+                bool closed = false;
+                size_t last = head;
+                for (size_t f = 0; f < frontier.size() && !closed; ++f) {
+                    size_t v = frontier[f];
+                    for (size_t w : edges[v]) {
+                        if (comp[w] != c) continue;
+                        if (w == head) {
+                            last = v;
+                            closed = true;
+                            break;
+                        }
+                        if (parent.emplace(w, v).second) {
+                            frontier.push_back(w);
+                        }
+                    }
+                }
+                std::vector<size_t> path{ last };
+                while (path.back() != head) {
+                    path.push_back(parent[path.back()]);
+                }
+                std::reverse(path.begin(), path.end());
+                path.push_back(head);
+
+                for (size_t k = 0; k < path.size(); ++k) {
+                    os << (k == 0 ? "    " : "      -> ");
+                    describe(path[k]);
+                    os << "\n";
+                }
+            }
+            os.flush();
+            return leaked;
+        }
+
+        template<typename T>
+        inline void leak_on_block(const void* ctrl, const T* object, AllocSite site, size_t count = 1) noexcept {
+            void (*traced)(const void*, size_t, std::vector<const void*>&) = nullptr;
+            if constexpr (is_traceable_impl<std::remove_cv_t<T>>::value) {
+                traced = &leak_traced_slots<std::remove_cv_t<T>>;
+            }
+            const char* type;
+            try {
+                type = type_name<T>();
+            }
+            catch (...) {
+                type = typeid(T).name();
+            }
+            LeakRegistry::instance().on_block(ctrl, object, sizeof(T) * count, count, type, site, traced);
+        }
+
+        inline void leak_on_object_destroyed(const void* ctrl) noexcept {
+            LeakRegistry::instance().on_object_destroyed(ctrl);
+        }
+
+        inline void leak_on_slot(const void* slot, const void* strong_ctrl) noexcept {
+            LeakRegistry::instance().on_slot(slot, strong_ctrl);
+        }
+    }
+
+    // Prints every managed object that is not reachable from a root through
+    // strong Ptrs, grouped by type and allocation site, with one path per
+    // strong cycle. Returns the number of unreachable objects.
+    inline size_t report_leaks(std::ostream& os = std::cerr) {
+        return detail::LeakRegistry::instance().report(os);
+    }
+
+    inline void set_leak_report_at_exit(bool enabled) {
+        detail::LeakRegistry::instance().set_report_at_exit(enabled);
+    }
+
+#else
+
+    namespace detail {
+        template<typename T>
+        inline void leak_on_block(const void*, const T*, AllocSite, size_t = 1) noexcept {}
+        inline void leak_on_object_destroyed(const void*) noexcept {}
+        inline void leak_on_slot(const void*, const void*) noexcept {}
+    }
+
+    inline size_t report_leaks(std::ostream& = std::cerr) {
+        return 0;
+    }
+
+    inline void set_leak_report_at_exit(bool) {}
+
+#endif
+
+}
@@ -0,0 +1,176 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <fstream>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace GC {
+
+    namespace detail {
+
+        // NUMA nodes and the node of each CPU, read once from sysfs. With
+        // a simulated topology (simulate_numa_nodes or GC_NUMA_NODES) each
+        // thread is assigned a node round-robin and no memory is bound.
+        class NumaTopology {
+        public:
+            static NumaTopology& instance() {
+                static NumaTopology* t = new NumaTopology();
+                return *t;
+            }
+
+            // One past the highest online node id; ids below it may be
+            // offline and then simply get no CPUs.
+            int node_count() const noexcept {
+                int sim = simulated_.load(std::memory_order_relaxed);
+                return sim > 0 ? sim : static_cast<int>(nodes_);
+            }
+
+            bool simulated() const noexcept {
+                return simulated_.load(std::memory_order_relaxed) > 0;
+            }
+
+            void simulate(int nodes) noexcept {
+                simulated_.store(nodes > 0 ? nodes : 0, std::memory_order_relaxed);
+            }
+
+            // Node of the CPU this thread runs on right now.
+            int current_node() noexcept {
+                int sim = simulated_.load(std::memory_order_relaxed);
+                if (sim > 0) {
+                    thread_local int ordinal = next_ordinal_.fetch_add(1, std::memory_order_relaxed);
+                    return ordinal % sim;
+                }
+#ifdef __linux__
+                int cpu = sched_getcpu();
+                if (cpu >= 0 && static_cast<size_t>(cpu) < cpu_node_.size()) {
+                    return cpu_node_[cpu];
+                }
+#endif
+                return 0;
+            }
+
+            // Asks the kernel to place [mem, mem + bytes) on `node`, moving
+            // pages already touched. A no-op on one node.
+            void bind(void* mem, size_t bytes, int node) const noexcept {
+#if defined(__linux__) && defined(SYS_mbind)
+                if (nodes_ < 2 || simulated() || node < 0 || node >= static_cast<int>(nodes_) || node >= 64) {
+                    return;
+                }
+                const int kMpolPreferred = 1;
+                const unsigned kMpolMfMove = 2;
+                unsigned long mask = 1ul << node;
+                syscall(SYS_mbind, mem, bytes, kMpolPreferred, &mask, sizeof(mask) * 8, kMpolMfMove);
+#else
+                (void)mem;
+                (void)bytes;
+                (void)node;
+#endif
+            }
+
+        private:
+            NumaTopology() {
+                if (const char* env = std::getenv("GC_NUMA_NODES")) {
+                    simulated_.store(std::atoi(env) > 0 ? std::atoi(env) : 0, std::memory_order_relaxed);
+                }
+#ifdef __linux__
+                // Node ids need not be contiguous (offline or memory-less
+                // nodes), so walk the online list rather than probing.
+                std::ifstream online("/sys/devices/system/node/online");
+                std::string nodes;
+                if (online && std::getline(online, nodes)) {
+                    for_each_in_list(nodes, [&](size_t node) {
+                        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                        std::string cpus;
+                        if (in && std::getline(in, cpus)) {
+                            for_each_in_list(cpus, [&](size_t cpu) {
+                                if (cpu_node_.size() <= cpu) {
+                                    cpu_node_.resize(cpu + 1, 0);
+                                }
+                                cpu_node_[cpu] = static_cast<int>(node);
+                            });
+                        }
+                        nodes_ = std::max(nodes_, node + 1);
+                    });
+                }
+#endif
+            }
+
+            // Calls f(i) for every i in a sysfs list such as "0-3,8-11".
+            template<typename F>
+            static void for_each_in_list(const std::string& list, F&& f) {
+                size_t pos = 0;
+                while (pos < list.size()) {
+                    size_t comma = list.find(',', pos);
+                    std::string range = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+                    size_t dash = range.find('-');
+                    size_t first = std::strtoul(range.c_str(), nullptr, 10);
+                    size_t last = dash == std::string::npos ? first : std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+                    if (!range.empty()) {
+                        for (size_t i = first; i <= last; ++i) {
+                            f(i);
+                        }
+                    }
+                    if (comma == std::string::npos) {
+                        break;
+                    }
+                    pos = comma + 1;
+                }
+            }
+
+            size_t nodes_ = 1;
+            std::vector<int> cpu_node_;
+            std::atomic<int> simulated_{ 0 };
+            std::atomic<int> next_ordinal_{ 0 };
+        };
+
+        // Node requested by New_on_node for the allocations of this thread,
+        // or -1 for the thread's own node.
+        inline thread_local int target_node = -1;
+    }
+
+    inline int numa_node_count() noexcept {
+        return detail::NumaTopology::instance().node_count();
+    }
+
+    inline int current_numa_node() noexcept {
+        return detail::NumaTopology::instance().current_node();
+    }
+
+    // Pretends the machine has `nodes` NUMA nodes (0 turns it off), for
+    // testing placement on a single-node box. Set it before the first
+    // allocation; threads are spread over the nodes round-robin.
+    inline void simulate_numa_nodes(int nodes) noexcept {
+        detail::NumaTopology::instance().simulate(nodes);
+    }
+
+    // Small GC blocks allocated by this thread while a NodeScope is alive
+    // come from pages placed on `node`.
+    class NodeScope {
+    public:
+        explicit NodeScope(int node) noexcept : saved_(detail::target_node) {
+            detail::target_node = node;
+        }
+
+        ~NodeScope() {
+            detail::target_node = saved_;
+        }
+
+        NodeScope(const NodeScope&) = delete;
+        NodeScope& operator=(const NodeScope&) = delete;
+
+    private:
+        int saved_;
+    };
+
+}
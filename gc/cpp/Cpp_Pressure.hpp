@@ -0,0 +1,325 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <fstream>
+#endif
+
+#include "Cpp_Deferred.hpp"
+#include "Cpp_Heap.hpp"
+
+namespace GC {
+
+    // How close heap_usage() is to the heap limit.
+    enum class Pressure {
+        Soft,   // past the soft threshold or the pacer's trigger: free what is cheap to free
+        Hard    // past the hard threshold: free everything that can go
+    };
+
+    namespace detail {
+
+        // heap_usage_bytes at which the next response runs, and
+        // heap_live_bytes at which the pacer runs the next collection.
+        inline std::atomic<size_t> pressure_trigger{ SIZE_MAX };
+        inline std::atomic<int64_t> pacer_trigger{ INT64_MAX };
+
+        // Spaces collections the way GOGC does: the next one runs once the
+        // live bytes have grown by `growth` percent over what the last one
+        // left. Live bytes rather than usage, since a fragmented heap keeps
+        // its pages after a collection.
+        // When collecting takes more than kMaxShare of the time (fast
+        // allocation, expensive collections) the step is stretched, up to
+        // kMaxStretch times; it shrinks back once the share is low again.
+        struct Pacer {
+            static constexpr double kMaxShare = 0.25;
+            static constexpr double kMaxStretch = 8.0;
+            static constexpr size_t kMinHeap = 4 * 1024 * 1024;
+
+            int growth = -1;      // percent; negative: off
+            uint64_t last_end = 0;
+            double stretch = 1.0;
+
+            void record(uint64_t start, uint64_t end) noexcept {
+                if (last_end && start > last_end) {
+                    double share = static_cast<double>(end - start) / static_cast<double>(end - last_end);
+                    if (share > kMaxShare) {
+                        stretch = std::min(stretch * 2, kMaxStretch);
+                    }
+                    else if (share < kMaxShare / 2) {
+                        stretch = std::max(stretch / 2, 1.0);
+                    }
+                }
+                last_end = end;
+            }
+
+            int64_t next(int64_t live) const noexcept {
+                if (growth < 0) {
+                    return INT64_MAX;
+                }
+                double next = static_cast<double>(live > 0 ? live : 0) * (1.0 + growth / 100.0 * stretch);
+                next = std::max(next, static_cast<double>(kMinHeap));
+                return next >= static_cast<double>(INT64_MAX) ? INT64_MAX : static_cast<int64_t>(next);
+            }
+        };
+
+        class HeapLimit {
+        public:
+            static HeapLimit& instance() {
+                static HeapLimit* l = new HeapLimit();
+                return *l;
+            }
+
+            void set(size_t limit, unsigned soft_percent, unsigned hard_percent) {
+                std::lock_guard<std::mutex> lock(mtx_);
+                limit_ = limit;
+                hard_ = limit / 100 * (hard_percent < 100 ? hard_percent : 100);
+                soft_ = limit / 100 * (soft_percent < hard_percent ? soft_percent : hard_percent);
+                rearm();
+            }
+
+            size_t limit() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                return limit_;
+            }
+
+            void set_growth(int percent) {
+                std::lock_guard<std::mutex> lock(mtx_);
+                pacer_.growth = percent;
+                rearm();
+            }
+
+            int growth() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                return pacer_.growth;
+            }
+
+            void add_callback(std::function<void(Pressure)> callback) {
+                std::lock_guard<std::mutex> lock(callback_mtx_);
+                callbacks_.push_back(std::move(callback));
+            }
+
+            // Runs on the allocating thread, inside the allocation that
+            // crossed the trigger: reconcile(), the callbacks and trim() all
+            // finish before it returns. One thread responds at a time; the
+            // others keep allocating.
+            void respond() noexcept {
+                bool idle = false;
+                if (!responding_.compare_exchange_strong(idle, true, std::memory_order_acquire)) {
+                    return;
+                }
+                PressureBlock block;
+                PassTimer timer(Metric::HeapCollectTime);
+                uint64_t start = now_ns();
+                size_t before = heap_usage_bytes.load(std::memory_order_relaxed);
+                bool hard;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    hard = limit_ != 0 && before >= hard_;
+                }
+                Pressure level = hard ? Pressure::Hard : Pressure::Soft;
+                // Best effort: running out of memory while freeing memory
+                // must not fail the allocation that got us here.
+                try {
+                    if (deferred_rc_active()) {
+                        reconcile();
+                    }
+                    // Called without the lock, so a callback may register
+                    // another one (it runs from the next response on).
+                    std::vector<std::function<void(Pressure)>> callbacks;
+                    {
+                        std::lock_guard<std::mutex> lock(callback_mtx_);
+                        callbacks = callbacks_;
+                    }
+                    for (const auto& callback : callbacks) {
+                        callback(level);
+                    }
+                }
+                catch (...) {
+                }
+                if (level == Pressure::Hard) {
+                    trim();
+                }
+                else {
+                    uint64_t now = now_ns();
+                    reclaim_abandoned(now);
+                    EmptyPages::instance().purge(now, 0);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    pacer_.record(start, now_ns());
+                    rearm();
+                }
+                responding_.store(false, std::memory_order_release);
+            }
+
+        private:
+            // The pacer's trigger, and usage growing another 1/16 of the limit
+            // past what the last response left (never later than the
+            // thresholds).
+            void rearm() noexcept {
+                pacer_trigger.store(pacer_.next(heap_live_bytes.load(std::memory_order_relaxed)),
+                    std::memory_order_relaxed);
+                size_t usage = heap_usage_bytes.load(std::memory_order_relaxed);
+                size_t next = SIZE_MAX;
+                if (limit_ != 0) {
+                    next = std::max(usage + limit_ / 16, soft_);
+                    if (usage < hard_) {
+                        next = std::min(next, hard_);
+                    }
+                }
+                pressure_trigger.store(next, std::memory_order_relaxed);
+            }
+
+            std::mutex mtx_;
+            size_t limit_ = 0;
+            size_t soft_ = 0;
+            size_t hard_ = 0;
+            Pacer pacer_;
+            std::atomic<bool> responding_{ false };
+            std::mutex callback_mtx_;
+            std::vector<std::function<void(Pressure)>> callbacks_;
+        };
+
+        inline void check_heap_pressure() noexcept {
+            if ((heap_usage_bytes.load(std::memory_order_relaxed) < pressure_trigger.load(std::memory_order_relaxed) &&
+                heap_live_bytes.load(std::memory_order_relaxed) < pacer_trigger.load(std::memory_order_relaxed)) ||
+                pressure_blocked) {
+                return;
+            }
+            HeapLimit::instance().respond();
+        }
+
+#ifdef __linux__
+        // Directory of this process's cgroup for `controller` ("" for the
+        // v2 hierarchy), or the mount root inside a cgroup namespace.
+        inline std::vector<std::string> cgroup_dirs(const std::string& controller) {
+            std::string base = controller.empty() ? "/sys/fs/cgroup" : "/sys/fs/cgroup/" + controller;
+            std::vector<std::string> dirs;
+            std::ifstream in("/proc/self/cgroup");
+            std::string line;
+            while (std::getline(in, line)) {
+                size_t first = line.find(':');
+                size_t second = line.find(':', first + 1);
+                if (first == std::string::npos || second == std::string::npos) {
+                    continue;
+                }
+                std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+                bool match = controller.empty()
+                    ? controllers == ",,"
+                    : controllers.find("," + controller + ",") != std::string::npos;
+                if (match) {
+                    dirs.push_back(base + line.substr(second + 1));
+                }
+            }
+            dirs.push_back(base);
+            return dirs;
+        }
+
+        // "max" and v1's page-rounded LLONG_MAX both read as 0: no limit.
+        inline bool read_cgroup_value(const std::string& path, size_t& value) {
+            std::ifstream in(path);
+            std::string text;
+            if (!(in >> text)) {
+                return false;
+            }
+            if (text == "max") {
+                value = 0;
+                return true;
+            }
+            unsigned long long v = std::strtoull(text.c_str(), nullptr, 10);
+            value = v >= (1ull << 62) ? 0 : static_cast<size_t>(v);
+            return true;
+        }
+#endif
+    }
+
+    struct CgroupMemory {
+        size_t current = 0;
+        size_t max = 0;   // 0 when unlimited
+    };
+
+    // Reads memory.current / memory.max (cgroup v2) or memory.usage_in_bytes
+    // / memory.limit_in_bytes (v1) of this process's cgroup. False when
+    // neither is available.
+    inline bool read_cgroup_memory(CgroupMemory& out) {
+#ifdef __linux__
+        for (const std::string& dir : detail::cgroup_dirs("")) {
+            if (detail::read_cgroup_value(dir + "/memory.current", out.current) &&
+                detail::read_cgroup_value(dir + "/memory.max", out.max)) {
+                return true;
+            }
+        }
+        for (const std::string& dir : detail::cgroup_dirs("memory")) {
+            if (detail::read_cgroup_value(dir + "/memory.usage_in_bytes", out.current) &&
+                detail::read_cgroup_value(dir + "/memory.limit_in_bytes", out.max)) {
+                return true;
+            }
+        }
+#else
+        (void)out;
+#endif
+        return false;
+    }
+
+    // Budget for heap_usage(); 0 (the default) means none. Crossing
+    // `soft_percent` of it runs a soft response on the allocating thread:
+    // deferred destruction is drained, pressure callbacks run and empty
+    // pages are released lazily. Crossing `hard_percent` runs a hard one,
+    // which ends with trim(). Either way the work is done synchronously
+    // inside the New that crossed the threshold, so that one allocation
+    // takes as long as the response. Allocations past the limit still
+    // succeed.
+    inline void set_heap_limit(size_t bytes, unsigned soft_percent = 75, unsigned hard_percent = 90) {
+        detail::HeapLimit::instance().set(bytes, soft_percent, hard_percent);
+    }
+
+    inline size_t heap_limit() {
+        return detail::HeapLimit::instance().limit();
+    }
+
+    // Sets the heap limit to `fraction` of the cgroup memory limit, leaving
+    // the rest for memory the GC does not manage. False (and no change)
+    // without a cgroup limit.
+    inline bool set_heap_limit_from_cgroup(double fraction = 0.8, unsigned soft_percent = 75, unsigned hard_percent = 90) {
+        CgroupMemory m;
+        if (!read_cgroup_memory(m) || m.max == 0) {
+            return false;
+        }
+        set_heap_limit(static_cast<size_t>(static_cast<double>(m.max) * fraction), soft_percent, hard_percent);
+        return true;
+    }
+
+    // GOGC for the heap: collect (as a soft response) whenever heap_live()
+    // has grown by `percent` over what the last collection left. If the
+    // allocation rate makes collections take over a quarter of the time,
+    // the step is stretched (up to 8x). The heap limit still applies on
+    // top. Negative (the default) turns pacing off. RefCounted objects are
+    // outside the GC heap and do not count towards the growth.
+    inline void set_growth_target(int percent) {
+        detail::HeapLimit::instance().set_growth(percent);
+    }
+
+    inline int growth_target() {
+        return detail::HeapLimit::instance().growth();
+    }
+
+    // Runs `callback` in every pressure response, on the thread whose
+    // allocation crossed the threshold and before that allocation returns:
+    // the place to drop caches or break cycles. No lock is held while it
+    // runs, so it may call on_memory_pressure itself. Allocating inside it
+    // does not trigger another response; exceptions it throws are ignored.
+    inline void on_memory_pressure(std::function<void(Pressure)> callback) {
+        detail::HeapLimit::instance().add_callback(std::move(callback));
+    }
+
+}
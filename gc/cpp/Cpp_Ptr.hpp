@@ -3,140 +3,752 @@
 
 #include <atomic>
 #include <memory>
+#include <new>
 #include <type_traits>
 #include <utility>
 #include <cassert>
+#include <cstdint>
 #include <thread>
 #include <vector>
 #include <chrono>
 #include <mutex>
 #include <functional>
 #include <string>
+#include <tuple>
+#include <iterator>
+
+#include "Cpp_Stats.hpp"
+#include "Cpp_Leak.hpp"
+#include "Cpp_Deferred.hpp"
+#include "Cpp_Coalesce.hpp"
+#include "Cpp_Heap.hpp"
+#include "Cpp_Pressure.hpp"
 
 namespace GC {
 
-    template<typename T> class Ptr;
+    template<typename T, typename = void> class Ptr;
+    template<typename T> class Protected;
+
+    namespace detail {
+        struct PtrAccess;
+
+        // Fallback for is_ref_counted; RefCounted declares a better match
+        // that argument-dependent lookup finds through the base class.
+        std::false_type gc_ref_counted_probe(const volatile void*) noexcept;
+
+        template<typename T>
+        using ref_counted_probe = decltype(gc_ref_counted_probe(static_cast<T*>(nullptr)));
+    }
 
+    // True for types derived from GC::RefCounted. Usable on a class that is
+    // still being defined (past its base clause), so such a type can hold a
+    // Ptr to itself.
     template<typename T>
-    class ControlBlock {
-    private:
-        std::atomic<size_t> gc_strong_count_;
-        std::atomic<size_t> gc_weak_count_;
-        std::atomic<T*> ptr_;
-        std::atomic<bool> object_destroyed_;
+    struct is_ref_counted : detail::ref_counted_probe<T> {};
+
+    // How a ControlBlock lays out its strong and weak counters.
+    //  Split  - two adjacent words (the default, 16 bytes).
+    //  Packed - one 8-byte word, strong count in the low half and weak in
+    //           the high half, read and CAS'd together. Counts are limited
+    //           to 2^32 - 1.
+    //  Padded - each counter on its own cache line, away from the object and
+    //           from each other, for objects whose counts many threads hit.
+    //           Costs two extra cache lines per block.
+    enum class CounterLayout {
+        Split,
+        Packed,
+        Padded
+    };
+
+    // Per-type layout choice. Either declare
+    //     static constexpr GC::CounterLayout gc_counter_layout = GC::CounterLayout::Padded;
+    // in the type, or specialize GC::counter_layout<T>.
+    template<typename T, typename = void>
+    struct counter_layout : std::integral_constant<CounterLayout, CounterLayout::Split> {};
+
+    template<typename T>
+    struct counter_layout<T, std::void_t<decltype(T::gc_counter_layout)>>
+        : std::integral_constant<CounterLayout, T::gc_counter_layout> {};
+
+    namespace detail {
+
+        inline constexpr size_t kCacheLine = 64;
+
+        // Split and Padded: one atomic word per counter, `Align` apart.
+        template<size_t Align>
+        class SplitCounters {
+        public:
+            explicit SplitCounters(size_t strong = 1) noexcept
+                : gc_strong_count_(strong), gc_weak_count_(1) {
+            }
+
+            size_t strong() const noexcept {
+                return gc_strong_count_.load(std::memory_order_acquire);
+            }
+
+            size_t weak() const noexcept {
+                return gc_weak_count_.load(std::memory_order_acquire);
+            }
+
+            void add_strong(size_t n) noexcept {
+                gc_strong_count_.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            // Returns the previous strong count. acq_rel so that the thread
+            // reaching zero sees every other owner's writes.
+            size_t sub_strong(size_t n) noexcept {
+                return gc_strong_count_.fetch_sub(n, std::memory_order_acq_rel);
+            }
+
+            bool try_add_strong() noexcept {
+                size_t count = gc_strong_count_.load(std::memory_order_acquire);
+                while (count > 0) {
+                    if (gc_strong_count_.compare_exchange_weak(
+                        count, count + 1,
+                        std::memory_order_acquire,
+                        std::memory_order_acquire)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void add_weak(size_t n) noexcept {
+                gc_weak_count_.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            // Returns the previous weak count.
+            size_t sub_weak(size_t n) noexcept {
+                return gc_weak_count_.fetch_sub(n, std::memory_order_acq_rel);
+            }
+
+        private:
+            alignas(Align) std::atomic<size_t> gc_strong_count_;
+            alignas(Align) std::atomic<size_t> gc_weak_count_;
+        };
+
+        class PackedCounters {
+        public:
+            explicit PackedCounters(size_t strong = 1) noexcept
+                : gc_counts_((uint64_t{ 1 } << 32) | strong) {
+            }
+
+            size_t strong() const noexcept {
+                return static_cast<size_t>(gc_counts_.load(std::memory_order_acquire) & kHalfMask);
+            }
+
+            size_t weak() const noexcept {
+                return static_cast<size_t>(gc_counts_.load(std::memory_order_acquire) >> 32);
+            }
+
+            void add_strong(size_t n) noexcept {
+                assert(strong() + n <= kHalfMask && "strong count overflow");
+                gc_counts_.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            size_t sub_strong(size_t n) noexcept {
+                return static_cast<size_t>(gc_counts_.fetch_sub(n, std::memory_order_acq_rel) & kHalfMask);
+            }
+
+            bool try_add_strong() noexcept {
+                uint64_t word = gc_counts_.load(std::memory_order_acquire);
+                while ((word & kHalfMask) != 0) {
+                    if (gc_counts_.compare_exchange_weak(
+                        word, word + 1,
+                        std::memory_order_acquire,
+                        std::memory_order_acquire)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void add_weak(size_t n) noexcept {
+                assert(weak() + n <= kHalfMask && "weak count overflow");
+                gc_counts_.fetch_add(static_cast<uint64_t>(n) << 32, std::memory_order_relaxed);
+            }
+
+            size_t sub_weak(size_t n) noexcept {
+                return static_cast<size_t>(gc_counts_.fetch_sub(static_cast<uint64_t>(n) << 32, std::memory_order_acq_rel) >> 32);
+            }
 
+            // Drops the last strong reference and the weak reference it
+            // holds in one CAS when no other reference exists.
+            bool release_sole() noexcept {
+                uint64_t sole = kSole;
+                return gc_counts_.compare_exchange_strong(sole, 0, std::memory_order_acq_rel, std::memory_order_relaxed);
+            }
+
+        private:
+            static constexpr uint64_t kHalfMask = 0xffffffffu;
+            static constexpr uint64_t kSole = (uint64_t{ 1 } << 32) | 1;
+
+            std::atomic<uint64_t> gc_counts_;
+        };
+
+        template<CounterLayout L>
+        struct CountersFor {
+            using type = SplitCounters<alignof(std::atomic<size_t>)>;
+        };
+
+        template<>
+        struct CountersFor<CounterLayout::Packed> {
+            using type = PackedCounters;
+        };
+
+        template<>
+        struct CountersFor<CounterLayout::Padded> {
+            using type = SplitCounters<kCacheLine>;
+        };
+    }
+
+    // Reference counts plus the knowledge of how to end the managed object.
+    // Blocks are type-erased: the concrete block (DeleterBlock, InplaceBlock,
+    // ...) keeps the original pointer and deleter, so a Ptr<Base> made from
+    // a Ptr<Derived> still destroys a Derived. Each Ptr carries the object
+    // pointer itself, already adjusted to its own T.
+    template<CounterLayout L>
+    class BasicControlBlock {
     public:
-        explicit ControlBlock(T* p) noexcept
-            : gc_strong_count_(1), gc_weak_count_(0), ptr_(p), object_destroyed_(false) {
-        }
+        static constexpr CounterLayout layout = L;
+
+        BasicControlBlock() noexcept = default;
 
-        ControlBlock(const ControlBlock&) = delete;
-        ControlBlock& operator=(const ControlBlock&) = delete;
+        BasicControlBlock(const BasicControlBlock&) = delete;
+        BasicControlBlock& operator=(const BasicControlBlock&) = delete;
 
         void add_strong() noexcept {
-            gc_strong_count_.fetch_add(1, std::memory_order_relaxed);
+            if (detail::coalescing_active()) {
+                detail::coalesce_delta(this, 1, &detail::apply_coalesced<BasicControlBlock>);
+                return;
+            }
+            counts_.add_strong(1);
         }
 
         void add_weak() noexcept {
-            gc_weak_count_.fetch_add(1, std::memory_order_relaxed);
+            counts_.add_weak(1);
         }
 
         bool try_add_strong() noexcept {
-            size_t count = gc_strong_count_.load(std::memory_order_acquire);
-            while (count > 0) {
-                if (gc_strong_count_.compare_exchange_weak(
-                    count, count + 1,
-                    std::memory_order_acquire,
-                    std::memory_order_acquire)) {
-                    return true;
-                }
-            }
-            return false;
+            return counts_.try_add_strong();
         }
 
         void release_strong() noexcept {
-            if (gc_strong_count_.fetch_sub(1, std::memory_order_release) == 1) {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                destroy_object();
-                if (gc_weak_count_.load(std::memory_order_acquire) == 0) {
-                    std::atomic_thread_fence(std::memory_order_acquire);
-                    delete this;
-                }
+            if (detail::coalescing_active()) {
+                detail::coalesce_delta(this, -1, &detail::apply_coalesced<BasicControlBlock>);
+                return;
+            }
+            drop_strong(1);
+        }
+
+        // Applies a net delta flushed from a coalescing buffer.
+        void apply_strong_delta(long delta) noexcept {
+            if (delta > 0) {
+                counts_.add_strong(static_cast<size_t>(delta));
+            }
+            else if (delta < 0) {
+                drop_strong(static_cast<size_t>(-delta));
             }
         }
 
         void release_weak() noexcept {
-            if (gc_weak_count_.fetch_sub(1, std::memory_order_release) == 1) {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                if (gc_strong_count_.load(std::memory_order_acquire) == 0) {
-                    std::atomic_thread_fence(std::memory_order_acquire);
-                    delete this;
-                }
+            if (counts_.sub_weak(1) == 1) {
+                destroy();
             }
         }
 
-        T* get_ptr() const noexcept {
-            return ptr_.load(std::memory_order_acquire);
+        // Called by reconcile() for a block taken out of the zero-count
+        // table, which holds a weak reference of its own.
+        void finish_deferred_release() noexcept {
+            if (counts_.strong() == 0) {
+                detail::CascadeScope cascade;
+                if (destroy_object()) {
+                    release_weak();
+                }
+            }
+            release_weak();
         }
 
         bool is_alive() const noexcept {
-            return gc_strong_count_.load(std::memory_order_acquire) > 0;
+            return counts_.strong() > 0;
         }
 
         size_t strong_count() const noexcept {
-            return gc_strong_count_.load(std::memory_order_acquire);
+            return counts_.strong();
         }
 
+        // Excludes the weak reference held on behalf of the strong ones.
         size_t weak_count() const noexcept {
-            return gc_weak_count_.load(std::memory_order_acquire);
+            size_t weak = counts_.weak();
+            return !disposed_.load(std::memory_order_acquire) && weak > 0 ? weak - 1 : weak;
         }
 
+    protected:
+        virtual ~BasicControlBlock() = default;
+
+        // Ends the lifetime of the managed object.
+        virtual void dispose() noexcept = 0;
+
+        // Frees the block once neither strong nor weak references remain.
+        virtual void destroy() noexcept = 0;
+
     private:
-        void destroy_object() noexcept {
-            bool expected = false;
-            if (object_destroyed_.compare_exchange_strong(
-                expected, true,
-                std::memory_order_acq_rel,
-                std::memory_order_acquire)) {
-
-                T* p = ptr_.exchange(nullptr, std::memory_order_acq_rel);
-                if (p) {
-                    delete p;
+        void drop_strong(size_t n) noexcept {
+            bool deferred = detail::deferred_rc_active();
+            if constexpr (L == CounterLayout::Packed) {
+                if (n == 1 && !deferred && counts_.release_sole()) {
+                    detail::CascadeScope cascade;
+                    destroy_object();
+                    destroy();
+                    return;
+                }
+            }
+            if (counts_.sub_strong(n) == n) {
+                if (deferred) {
+                    // The zero-count table keeps the block itself alive.
+                    counts_.add_weak(1);
+                    if (!detail::defer_zero_count(this, &detail::finish_deferred<BasicControlBlock>)) {
+                        counts_.sub_weak(1);
+                    }
+                    return;
+                }
+                detail::CascadeScope cascade;
+                if (destroy_object()) {
+                    release_weak();
                 }
             }
         }
+
+        // Returns false if the object was already gone (a block revived
+        // from the zero-count table can reach zero twice).
+        bool destroy_object() noexcept {
+            if (disposed_.exchange(true, std::memory_order_acq_rel)) {
+                return false;
+            }
+            detail::leak_on_object_destroyed(this);
+            detail::cascade_count_object();
+            dispose();
+            return true;
+        }
+
+        // The flag comes first so that with Padded counters it shares the
+        // vtable's line, not a counter's.
+        std::atomic<bool> disposed_{ false };
+
+        // The strong references collectively hold one weak reference,
+        // dropped once the object is destroyed. Whoever takes the weak
+        // count to zero frees the block; no other path does.
+        typename detail::CountersFor<L>::type counts_;
     };
 
+    // The block type a Ptr<T> points to. Ptrs of different types can share
+    // a block as long as their types use the same counter layout.
     template<typename T>
+    using ControlBlock = BasicControlBlock<counter_layout<std::remove_cv_t<T>>::value>;
+
+    // Base for intrusively counted types:
+    //     struct Node : GC::RefCounted<Node> { GC::Ptr<Node> next; };
+    // The counters live inside the object, so GC::New<Node> makes a single
+    // allocation and Ptr<Node> is one pointer wide. Weak references (Ref,
+    // safe) work as usual: they keep the memory alive, not the object.
+    //
+    // Objects come from GC::New, or from plain `new` and are then adopted by
+    // Ptr's raw pointer constructor; wrapping `this` again later is fine.
+    // A class derived from T needs T's destructor to be virtual and T at the
+    // start of the object (single inheritance). Counts are always updated in
+    // place: deferred and coalesced modes do not apply, and these Ptrs take
+    // no custom deleter or allocator and do not work with StackRef,
+    // Protected or EpochDomain.
+    template<typename T, CounterLayout L = CounterLayout::Packed>
+    class RefCounted {
+    public:
+        using gc_ref_counted = RefCounted;
+
+    protected:
+        RefCounted() noexcept : gc_counts_(0) {}
+
+        // A copy is a new object with counts of its own.
+        RefCounted(const RefCounted&) noexcept : gc_counts_(0) {}
+
+        RefCounted& operator=(const RefCounted&) noexcept {
+            return *this;
+        }
+
+        ~RefCounted() = default;
+
+    private:
+        template<typename, typename> friend class Ptr;
+
+        friend std::true_type gc_ref_counted_probe(const volatile RefCounted*) noexcept {
+            return {};
+        }
+
+        // Start of the allocation holding the object.
+        void* gc_memory() const noexcept {
+            return const_cast<T*>(static_cast<const T*>(this));
+        }
+
+        void gc_add_strong() const noexcept {
+            gc_counts_.add_strong(1);
+        }
+
+        bool gc_try_add_strong() const noexcept {
+            return gc_counts_.try_add_strong();
+        }
+
+        void gc_add_weak() const noexcept {
+            gc_counts_.add_weak(1);
+        }
+
+        void gc_release_strong() const noexcept {
+            if constexpr (L == CounterLayout::Packed) {
+                if (gc_counts_.release_sole()) {
+                    detail::CascadeScope cascade;
+                    void* memory = gc_destroy_object();
+                    ::operator delete(memory);
+                    return;
+                }
+            }
+            if (gc_counts_.sub_strong(1) == 1) {
+                detail::CascadeScope cascade;
+                gc_destroy_object();
+                gc_release_weak();
+            }
+        }
+
+        // The counters are trivially destructible, so they stay usable in
+        // the object's storage after ~T until the memory is freed.
+        void gc_release_weak() const noexcept {
+            if (gc_counts_.sub_weak(1) == 1) {
+                ::operator delete(gc_memory());
+            }
+        }
+
+        void* gc_destroy_object() const noexcept {
+            void* memory = gc_memory();
+            detail::leak_on_object_destroyed(this);
+            detail::cascade_count_object();
+            static_cast<const T*>(this)->~T();
+            return memory;
+        }
+
+        size_t gc_strong_count() const noexcept {
+            return gc_counts_.strong();
+        }
+
+        // Excludes the weak reference held on behalf of the strong ones.
+        size_t gc_weak_count() const noexcept {
+            size_t weak = gc_counts_.weak();
+            return gc_counts_.strong() > 0 && weak > 0 ? weak - 1 : weak;
+        }
+
+        mutable typename detail::CountersFor<L>::type gc_counts_;
+    };
+
+    namespace detail {
+
+        // Holds an allocator, taking no space when it is stateless.
+        template<typename A, bool = std::is_empty_v<A> && !std::is_final_v<A>>
+        class AllocHolder : private A {
+        public:
+            explicit AllocHolder(const A& a) noexcept : A(a) {}
+            A& allocator() noexcept { return *this; }
+        };
+
+        template<typename A>
+        class AllocHolder<A, false> {
+        public:
+            explicit AllocHolder(const A& a) noexcept : a_(a) {}
+            A& allocator() noexcept { return a_; }
+        private:
+            A a_;
+        };
+
+        // Block for Ptr(p[, deleter[, alloc]]): the deleter ends the object,
+        // the block itself comes from `A`.
+        template<typename T, typename D, typename A>
+        class DeleterBlock final
+            : private AllocHolder<typename std::allocator_traits<A>::template rebind_alloc<DeleterBlock<T, D, A>>>,
+            public ControlBlock<T> {
+        public:
+            using BlockAlloc = typename std::allocator_traits<A>::template rebind_alloc<DeleterBlock>;
+
+            DeleterBlock(T* p, D deleter, const BlockAlloc& alloc) noexcept
+                : AllocHolder<BlockAlloc>(alloc), ptr_(p), deleter_(std::move(deleter)) {
+                leak_on_block(this, p, AllocSite{ nullptr, 0 });
+            }
+
+        protected:
+            void dispose() noexcept override {
+                deleter_(ptr_);
+            }
+
+            void destroy() noexcept override {
+                BlockAlloc alloc(this->allocator());
+                this->~DeleterBlock();
+                std::allocator_traits<BlockAlloc>::deallocate(alloc, this, 1);
+            }
+
+        private:
+            T* ptr_;
+            D deleter_;
+        };
+
+        // Raw storage for the object, constructed from the block's
+        // initializer list.
+        template<typename T>
+        class InplaceStorage {
+        protected:
+            template<typename A, typename... Args>
+            explicit InplaceStorage(A& alloc, Args&&... args) {
+                std::allocator_traits<A>::construct(alloc, object(), std::forward<Args>(args)...);
+            }
+
+            T* object() noexcept {
+                return reinterpret_cast<T*>(&storage_);
+            }
+
+        private:
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+        };
+
+        // Block for GC::allocate / GC::New: object and counters share one
+        // allocation obtained from `A`.
+        template<typename T, typename A>
+        class InplaceBlock final
+            : private AllocHolder<typename std::allocator_traits<A>::template rebind_alloc<InplaceBlock<T, A>>>,
+            private InplaceStorage<T>,
+            public ControlBlock<T> {
+        public:
+            using BlockAlloc = typename std::allocator_traits<A>::template rebind_alloc<InplaceBlock>;
+            using ObjectAlloc = typename std::allocator_traits<A>::template rebind_alloc<T>;
+
+            template<typename... Args>
+            InplaceBlock(const BlockAlloc& alloc, ObjectAlloc& object_alloc, AllocSite site, Args&&... args)
+                : AllocHolder<BlockAlloc>(alloc),
+                InplaceStorage<T>(object_alloc, std::forward<Args>(args)...) {
+                leak_on_block(this, this->object(), site);
+            }
+
+            T* get() noexcept {
+                return this->object();
+            }
+
+        protected:
+            void dispose() noexcept override {
+                ObjectAlloc alloc(this->allocator());
+                std::allocator_traits<ObjectAlloc>::destroy(alloc, this->object());
+            }
+
+            void destroy() noexcept override {
+                BlockAlloc alloc(this->allocator());
+                this->~InplaceBlock();
+                std::allocator_traits<BlockAlloc>::deallocate(alloc, this, 1);
+            }
+        };
+
+        // A strong reference whose release has been postponed by one of the
+        // reclamation schemes (epochs, hazard pointers).
+        struct RetiredRef {
+            void* ctrl;
+            void (*release)(void*) noexcept;
+            uint64_t epoch;
+        };
+
+        template<typename T>
+        void release_retired(void* ctrl) noexcept {
+            static_cast<ControlBlock<T>*>(ctrl)->release_strong();
+        }
+
+        // Instantiated with the block type itself, not an object type: the
+        // counter layout is part of it.
+        template<typename Block>
+        void apply_coalesced(void* ctrl, long delta) noexcept {
+            static_cast<Block*>(ctrl)->apply_strong_delta(delta);
+        }
+
+        template<typename Block>
+        void finish_deferred(void* ctrl) noexcept {
+            static_cast<Block*>(ctrl)->finish_deferred_release();
+        }
+
+        // Placeholder stored in a slot's block pointer while exchange()
+        // updates the slot, so hazard readers never pair one block with
+        // another block's object pointer.
+        inline char slot_busy_tag;
+
+        template<typename T>
+        ControlBlock<T>* slot_busy() noexcept {
+            return reinterpret_cast<ControlBlock<T>*>(&slot_busy_tag);
+        }
+
+        // Lets library components adopt a block they built into a Ptr.
+        struct PtrAccess {
+            template<typename T>
+            static Ptr<T> adopt(ControlBlock<T>* ctrl, T* ptr) noexcept {
+                // Spelled out: is_ref_counted<T> may have been fixed while T
+                // was only declared.
+                static_assert(!decltype(gc_ref_counted_probe(static_cast<T*>(nullptr)))::value,
+                    "RefCounted types need GC::New, and Ptr<T> must not be used before T is defined");
+                return Ptr<T>(ctrl, ptr, false);
+            }
+
+            template<typename T>
+            static Ptr<T> adopt_new(T* ptr) noexcept {
+                Ptr<T> p;
+                p.adopt_new(ptr);
+                return p;
+            }
+
+            template<typename T>
+            static Ptr<T[]> adopt_array(ControlBlock<T>* ctrl, T* elems, size_t n) noexcept {
+                return Ptr<T[]>(Ptr<T>(ctrl, elems, false), n);
+            }
+
+            // Empties a strong Ptr without releasing; the caller now owns the
+            // strong reference it held.
+            template<typename T>
+            static ControlBlock<T>* detach(Ptr<T>& p) noexcept {
+                assert(!p.is_weak() && "detach() needs a strong Ptr");
+                ControlBlock<T>* ctrl = p.ctrl_.exchange(nullptr, std::memory_order_acq_rel);
+                p.ptr_.store(nullptr, std::memory_order_release);
+                p.track();
+                return ctrl;
+            }
+
+            template<typename T>
+            static const Ptr<T>& elements(const Ptr<T[]>& p) noexcept {
+                return p.elems_;
+            }
+
+            // The block a strong Ptr refers to, or null (no count change).
+            template<typename T>
+            static ControlBlock<T>* strong_ctrl(const Ptr<T>& p) noexcept {
+                return p.is_weak() ? nullptr : p.ctrl_.load(std::memory_order_acquire);
+            }
+
+            // Publishes `value` in the strong slot `slot` and returns the block
+            // previously stored there, still holding its reference. Concurrent
+            // readers see either the old or the new target through get() and
+            // protect(). The block pointer holds slot_busy in between, so
+            // anything else that reads it (copies, casts, lock(), ref_count(),
+            // reset, the destructor) must not run on the slot meanwhile;
+            // debug builds assert on it.
+            template<typename T>
+            static ControlBlock<T>* exchange(Ptr<T>& slot, Ptr<T>&& value) noexcept {
+                assert(!slot.is_weak() && "exchange() needs a strong slot");
+                T* ptr = value.ptr_.load(std::memory_order_acquire);
+                ControlBlock<T>* ctrl = detach(value);
+                ControlBlock<T>* old = slot.ctrl_.exchange(slot_busy<T>(), std::memory_order_acq_rel);
+                slot.ptr_.store(ptr, std::memory_order_release);
+                slot.ctrl_.store(ctrl, std::memory_order_release);
+                slot.track();
+                return old;
+            }
+        };
+
+        template<typename T, typename A, typename... Args>
+        Ptr<T> allocate_at(AllocSite site, const A& alloc, Args&&... args) {
+            safepoint_poll();
+            using Block = InplaceBlock<T, A>;
+            typename Block::BlockAlloc block_alloc(alloc);
+            typename Block::ObjectAlloc object_alloc(alloc);
+            Block* mem = std::allocator_traits<typename Block::BlockAlloc>::allocate(block_alloc, 1);
+            Block* block;
+            try {
+                block = ::new (static_cast<void*>(mem)) Block(block_alloc, object_alloc, site,
+                    std::forward<Args>(args)...);
+            }
+            catch (...) {
+                std::allocator_traits<typename Block::BlockAlloc>::deallocate(block_alloc, mem, 1);
+                throw;
+            }
+            return PtrAccess::adopt<T>(block, block->get());
+        }
+    }
+
+    template<typename T, typename>
     class Ptr {
     private:
         std::atomic<ControlBlock<T>*> ctrl_;
+        std::atomic<T*> ptr_;
         std::atomic<bool> is_weak_;
 
-        explicit Ptr(ControlBlock<T>* ctrl, bool is_weak) noexcept
-            : ctrl_(ctrl), is_weak_(is_weak) {
+        explicit Ptr(ControlBlock<T>* ctrl, T* ptr, bool is_weak) noexcept
+            : ctrl_(ctrl), ptr_(ptr), is_weak_(is_weak) {
+            track();
+        }
+
+        template<typename U>
+        static constexpr void check_shared_layout() noexcept {
+            static_assert(std::is_same_v<ControlBlock<U>, ControlBlock<T>>,
+                "Ptr<T> and Ptr<U> can only share ownership if T and U use the same GC::CounterLayout");
         }
 
-        template<typename U> friend class Ptr;
+        template<typename, typename> friend class Ptr;
+        friend struct detail::PtrAccess;
 
     public:
-        constexpr Ptr() noexcept : ctrl_(nullptr), is_weak_(false) {}
-        constexpr Ptr(std::nullptr_t) noexcept : ctrl_(nullptr), is_weak_(false) {}
+        using element_type = T;
+
+        constexpr Ptr() noexcept : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {}
+        constexpr Ptr(std::nullptr_t) noexcept : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {}
+
+        // Takes ownership of `ptr`; it is deleted as a U* even when T is a
+        // base without a virtual destructor.
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        explicit Ptr(U* ptr) : Ptr(ptr, std::default_delete<U>()) {}
+
+        // Takes ownership of `ptr`; `deleter(ptr)` runs when the last strong
+        // reference goes away.
+        template<typename U, typename D, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        Ptr(U* ptr, D deleter) : Ptr(ptr, std::move(deleter), PoolAllocator<U>()) {}
 
-        explicit Ptr(T* ptr) : ctrl_(nullptr), is_weak_(false) {
+        // As above, with the control block obtained from `alloc`.
+        template<typename U, typename D, typename A, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        Ptr(U* ptr, D deleter, const A& alloc) : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {
+            check_shared_layout<U>();
             if (ptr) {
+                using Block = detail::DeleterBlock<U, D, A>;
+                typename Block::BlockAlloc block_alloc(alloc);
                 try {
-                    ctrl_.store(new ControlBlock<T>(ptr), std::memory_order_release);
+                    Block* mem = std::allocator_traits<typename Block::BlockAlloc>::allocate(block_alloc, 1);
+                    ctrl_.store(::new (static_cast<void*>(mem)) Block(ptr, deleter, block_alloc),
+                        std::memory_order_release);
                 }
                 catch (...) {
-                    delete ptr;
+                    deleter(ptr);
                     throw;
                 }
+                ptr_.store(ptr, std::memory_order_release);
+                track();
+            }
+        }
+
+        // Aliasing constructor: shares ownership (strong or weak) with
+        // `owner` but points at `ptr`, typically a member or base of it.
+        template<typename U>
+        Ptr(const Ptr<U>& owner, T* ptr) noexcept : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {
+            check_shared_layout<U>();
+            ControlBlock<T>* other_ctrl = owner.load_ctrl();
+            bool other_weak = owner.is_weak_.load(std::memory_order_acquire);
+
+            if (other_ctrl) {
+                if (other_weak) {
+                    other_ctrl->add_weak();
+                }
+                else {
+                    other_ctrl->add_strong();
+                }
+                ptr_.store(ptr, std::memory_order_release);
             }
+            ctrl_.store(other_ctrl, std::memory_order_release);
+            is_weak_.store(other_weak, std::memory_order_release);
+            track();
         }
 
-        Ptr(const Ptr& other) noexcept : ctrl_(nullptr), is_weak_(false) {
-            ControlBlock<T>* other_ctrl = other.ctrl_.load(std::memory_order_acquire);
+        Ptr(const Ptr& other) noexcept : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {
+            ControlBlock<T>* other_ctrl = other.load_ctrl();
             bool other_weak = other.is_weak_.load(std::memory_order_acquire);
 
             if (other_ctrl) {
@@ -148,36 +760,68 @@ namespace GC {
                 }
             }
             ctrl_.store(other_ctrl, std::memory_order_release);
+            ptr_.store(other.ptr_.load(std::memory_order_acquire), std::memory_order_release);
             is_weak_.store(other_weak, std::memory_order_release);
+            track();
         }
 
         Ptr(Ptr&& other) noexcept
             : ctrl_(other.ctrl_.exchange(nullptr, std::memory_order_acq_rel)),
+            ptr_(other.ptr_.exchange(nullptr, std::memory_order_acq_rel)),
             is_weak_(other.is_weak_.exchange(false, std::memory_order_acq_rel)) {
+            track();
+            other.track();
         }
 
+        // Upcast. The object pointer is adjusted once here, so later access
+        // costs nothing. A weak source is locked for the conversion because
+        // adjusting a dangling pointer to a virtual base is undefined.
         template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
-        Ptr(const Ptr<U>& other) noexcept : ctrl_(nullptr), is_weak_(false) {
-            auto other_ctrl = other.ctrl_.load(std::memory_order_acquire);
+        Ptr(const Ptr<U>& other) noexcept : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {
+            check_shared_layout<U>();
+            ControlBlock<T>* other_ctrl = other.load_ctrl();
             bool other_weak = other.is_weak_.load(std::memory_order_acquire);
 
-            ControlBlock<T>* converted_ctrl = reinterpret_cast<ControlBlock<T>*>(other_ctrl);
-
-            if (converted_ctrl) {
+            if (other_ctrl) {
                 if (other_weak) {
-                    converted_ctrl->add_weak();
+                    other_ctrl->add_weak();
+                    if (Ptr<U> strong = other.lock()) {
+                        ptr_.store(strong.get(), std::memory_order_release);
+                    }
                 }
                 else {
-                    converted_ctrl->add_strong();
+                    other_ctrl->add_strong();
+                    ptr_.store(other.ptr_.load(std::memory_order_acquire), std::memory_order_release);
                 }
             }
 
-            ctrl_.store(converted_ctrl, std::memory_order_release);
+            ctrl_.store(other_ctrl, std::memory_order_release);
             is_weak_.store(other_weak, std::memory_order_release);
+            track();
+        }
+
+        // Upcast taking over `other`'s reference: no count traffic at all.
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        Ptr(Ptr<U>&& other) noexcept : ctrl_(nullptr), ptr_(nullptr), is_weak_(false) {
+            check_shared_layout<U>();
+            bool other_weak = other.is_weak_.load(std::memory_order_acquire);
+            if (other_weak) {
+                Ptr tmp(other);
+                swap(tmp);
+                other.reset();
+                return;
+            }
+            ptr_.store(other.ptr_.exchange(nullptr, std::memory_order_acq_rel), std::memory_order_release);
+            ctrl_.store(other.ctrl_.exchange(nullptr, std::memory_order_acq_rel), std::memory_order_release);
+            track();
+            other.track();
         }
 
         ~Ptr() {
             release();
+#ifdef GC_LEAK_DETECTOR
+            detail::leak_on_slot(this, nullptr);
+#endif
         }
 
         Ptr& operator=(const Ptr& other) noexcept {
@@ -193,8 +837,12 @@ namespace GC {
                 release();
                 ctrl_.store(other.ctrl_.exchange(nullptr, std::memory_order_acq_rel),
                     std::memory_order_release);
+                ptr_.store(other.ptr_.exchange(nullptr, std::memory_order_acq_rel),
+                    std::memory_order_release);
                 is_weak_.store(other.is_weak_.exchange(false, std::memory_order_acq_rel),
                     std::memory_order_release);
+                track();
+                other.track();
             }
             return *this;
         }
@@ -205,28 +853,28 @@ namespace GC {
         }
 
         Ptr safe(const Ptr& strong_ref) const {
-            ControlBlock<T>* ref_ctrl = strong_ref.ctrl_.load(std::memory_order_acquire);
+            ControlBlock<T>* ref_ctrl = strong_ref.load_ctrl();
             bool ref_weak = strong_ref.is_weak_.load(std::memory_order_acquire);
 
             if (!ref_ctrl || ref_weak) {
                 return Ptr();
             }
-            Ptr weak_ptr;
-            weak_ptr.ctrl_.store(ref_ctrl, std::memory_order_release);
-            weak_ptr.is_weak_.store(true, std::memory_order_release);
             ref_ctrl->add_weak();
-            return weak_ptr;
+            return Ptr(ref_ctrl, strong_ref.ptr_.load(std::memory_order_acquire), true);
         }
 
+        // Reads this slot under a hazard pointer (see Cpp_Hazard.hpp).
+        Protected<T> protect() const;
+
         Ptr lock() const {
             bool weak = is_weak_.load(std::memory_order_acquire);
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
+            ControlBlock<T>* ctrl = load_ctrl();
 
             if (!weak || !ctrl) {
                 return Ptr(*this);
             }
             if (ctrl->try_add_strong()) {
-                return Ptr(ctrl, false);
+                return Ptr(ctrl, ptr_.load(std::memory_order_acquire), false);
             }
             return Ptr();
         }
@@ -235,45 +883,46 @@ namespace GC {
             if (this == &other) return;
             release();
 
-            ControlBlock<T>* other_ctrl = other.ctrl_.load(std::memory_order_acquire);
+            ControlBlock<T>* other_ctrl = other.load_ctrl();
             bool other_weak = other.is_weak_.load(std::memory_order_acquire);
 
             if (other_ctrl && !other_weak) {
                 other_ctrl->add_weak();
                 ctrl_.store(other_ctrl, std::memory_order_release);
+                ptr_.store(other.ptr_.load(std::memory_order_acquire), std::memory_order_release);
                 is_weak_.store(true, std::memory_order_release);
             }
+            else {
+                ctrl_.store(nullptr, std::memory_order_release);
+                ptr_.store(nullptr, std::memory_order_release);
+                is_weak_.store(false, std::memory_order_release);
+            }
+            track();
         }
 
         bool expired() const noexcept {
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
+            ControlBlock<T>* ctrl = load_ctrl();
             return !ctrl || !ctrl->is_alive();
         }
 
         T* get() const noexcept {
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
-            if (!ctrl) {
-                return nullptr;
-            }
             bool weak = is_weak_.load(std::memory_order_acquire);
             if (weak) {
                 return nullptr;
             }
-            return ctrl->get_ptr();
+            return ptr_.load(std::memory_order_acquire);
         }
 
         T& operator*() const noexcept {
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
-            bool weak = is_weak_.load(std::memory_order_acquire);
-            assert(!weak && ctrl && "Dereferencing null");
-            return *ctrl->get_ptr();
+            T* ptr = get();
+            assert(ptr && "Dereferencing null");
+            return *ptr;
         }
 
         T* operator->() const noexcept {
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
-            bool weak = is_weak_.load(std::memory_order_acquire);
-            assert(!weak && ctrl && "Accessing through null");
-            return ctrl->get_ptr();
+            T* ptr = get();
+            assert(ptr && "Accessing through null");
+            return ptr;
         }
 
         explicit operator bool() const noexcept {
@@ -285,12 +934,12 @@ namespace GC {
         }
 
         size_t ref_count() const noexcept {
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
+            ControlBlock<T>* ctrl = load_ctrl();
             return ctrl ? ctrl->strong_count() : 0;
         }
 
         size_t weak_count() const noexcept {
-            ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
+            ControlBlock<T>* ctrl = load_ctrl();
             return ctrl ? ctrl->weak_count() : 0;
         }
 
@@ -305,24 +954,34 @@ namespace GC {
         void reset() noexcept {
             release();
             ctrl_.store(nullptr, std::memory_order_release);
+            ptr_.store(nullptr, std::memory_order_release);
             is_weak_.store(false, std::memory_order_release);
+            track();
         }
 
-        void reset(T* ptr) {
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        void reset(U* ptr) {
             Ptr tmp(ptr);
             swap(tmp);
         }
 
         void swap(Ptr& other) noexcept {
             ControlBlock<T>* my_ctrl = ctrl_.exchange(
-                other.ctrl_.load(std::memory_order_acquire),
+                other.load_ctrl(),
                 std::memory_order_acq_rel);
             other.ctrl_.store(my_ctrl, std::memory_order_release);
 
+            T* my_ptr = ptr_.exchange(
+                other.ptr_.load(std::memory_order_acquire),
+                std::memory_order_acq_rel);
+            other.ptr_.store(my_ptr, std::memory_order_release);
+
             bool my_weak = is_weak_.exchange(
                 other.is_weak_.load(std::memory_order_acquire),
                 std::memory_order_acq_rel);
             other.is_weak_.store(my_weak, std::memory_order_release);
+            track();
+            other.track();
         }
 
         bool operator==(const Ptr& other) const noexcept {
@@ -342,8 +1001,27 @@ namespace GC {
         }
 
     private:
-        void release() noexcept {
+        // The block pointer, for everything but protect(). A slot that
+        // EpochDomain/HazardDomain::replace() is updating holds
+        // detail::slot_busy meanwhile; see PtrAccess::exchange.
+        ControlBlock<T>* load_ctrl() const noexcept {
             ControlBlock<T>* ctrl = ctrl_.load(std::memory_order_acquire);
+            assert(ctrl != detail::slot_busy<T>() &&
+                "Ptr used while replace() updates it; read it with protect() or get() in a ReadGuard");
+            return ctrl;
+        }
+
+        // Records this slot with the leak detector (no-op unless GC_LEAK_DETECTOR).
+        void track() noexcept {
+#ifdef GC_LEAK_DETECTOR
+            ControlBlock<T>* ctrl = load_ctrl();
+            bool weak = is_weak_.load(std::memory_order_acquire);
+            detail::leak_on_slot(this, (ctrl && !weak) ? ctrl : nullptr);
+#endif
+        }
+
+        void release() noexcept {
+            ControlBlock<T>* ctrl = load_ctrl();
             if (ctrl) {
                 bool weak = is_weak_.load(std::memory_order_acquire);
                 if (weak) {
@@ -356,12 +1034,794 @@ namespace GC {
         }
     };
 
-    template<typename T, typename... Args>
-    Ptr<T> New(Args&&... args) {
-        return Ptr<T>(new T(std::forward<Args>(args)...));
-    }
+    // Ptr to a RefCounted type: one atomic word holding the object pointer,
+    // its low bit marking a weak reference. The counts are found from the
+    // object pointer itself. Same interface as the general Ptr, minus custom
+    // deleters and protect().
+    template<typename T>
+    class Ptr<T, std::enable_if_t<is_ref_counted<T>::value>> {
+    private:
+        static constexpr uintptr_t kWeakBit = 1;
 
-#define GC_REF(ptr, member, value) (ptr)->member.Ref(value)
+        std::atomic<uintptr_t> bits_;
+
+        // Takes over a reference the caller already counted.
+        Ptr(T* ptr, bool is_weak) noexcept : bits_(pack(ptr, is_weak)) {
+            track();
+        }
+
+        static uintptr_t pack(T* ptr, bool is_weak) noexcept {
+            return reinterpret_cast<uintptr_t>(ptr) | (is_weak ? kWeakBit : 0);
+        }
+
+        static T* object_of(uintptr_t bits) noexcept {
+            return reinterpret_cast<T*>(bits & ~kWeakBit);
+        }
+
+        static bool is_weak_bits(uintptr_t bits) noexcept {
+            return (bits & kWeakBit) != 0;
+        }
+
+        static auto counted(T* ptr) noexcept {
+            using Counted = typename std::remove_cv_t<T>::gc_ref_counted;
+            return static_cast<const Counted*>(ptr);
+        }
+
+        template<typename, typename> friend class Ptr;
+        friend struct detail::PtrAccess;
+
+    public:
+        using element_type = T;
+
+        constexpr Ptr() noexcept : bits_(0) {}
+        constexpr Ptr(std::nullptr_t) noexcept : bits_(0) {}
+
+        // Adds a strong reference to `ptr`, which came from GC::New or
+        // plain `new`. Counting starts at zero, so a fresh object is owned
+        // by its first Ptr and a live one can be wrapped again. A fresh one
+        // from plain `new` is registered with the leak detector here.
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        explicit Ptr(U* ptr) : bits_(0) {
+            if (ptr) {
+                check_adoptable(ptr);
+#ifdef GC_LEAK_DETECTOR
+                if (counted(ptr)->gc_strong_count() == 0) {
+                    detail::leak_on_block(counted(ptr), ptr, AllocSite{ nullptr, 0 });
+                }
+#endif
+                counted(ptr)->gc_add_strong();
+                bits_.store(pack(ptr, false), std::memory_order_release);
+            }
+            track();
+        }
+
+        // Points at `ptr`, which must be the same object as `owner`'s seen
+        // through another type (this is what the pointer casts use).
+        template<typename U>
+        Ptr(const Ptr<U>& owner, T* ptr) noexcept : bits_(0) {
+            uintptr_t other = owner.bits_.load(std::memory_order_acquire);
+            if (ptr) {
+                bool weak = is_weak_bits(other);
+                assert((weak || static_cast<const void*>(counted(ptr)) ==
+                    static_cast<const void*>(Ptr<U>::counted(Ptr<U>::object_of(other)))) &&
+                    "intrusive Ptrs can only alias the same object");
+                if (weak) {
+                    counted(ptr)->gc_add_weak();
+                }
+                else {
+                    counted(ptr)->gc_add_strong();
+                }
+                bits_.store(pack(ptr, weak), std::memory_order_release);
+            }
+            track();
+        }
+
+        Ptr(const Ptr& other) noexcept : bits_(0) {
+            uintptr_t bits = other.bits_.load(std::memory_order_acquire);
+            if (T* ptr = object_of(bits)) {
+                if (is_weak_bits(bits)) {
+                    counted(ptr)->gc_add_weak();
+                }
+                else {
+                    counted(ptr)->gc_add_strong();
+                }
+            }
+            bits_.store(bits, std::memory_order_release);
+            track();
+        }
+
+        Ptr(Ptr&& other) noexcept : bits_(other.bits_.exchange(0, std::memory_order_acq_rel)) {
+            track();
+            other.track();
+        }
+
+        // Upcast. A weak source is locked for the conversion, as in the
+        // general Ptr.
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        Ptr(const Ptr<U>& other) noexcept : bits_(0) {
+            uintptr_t bits = other.bits_.load(std::memory_order_acquire);
+            if (!is_weak_bits(bits)) {
+                if (T* ptr = Ptr<U>::object_of(bits)) {
+                    counted(ptr)->gc_add_strong();
+                    bits_.store(pack(ptr, false), std::memory_order_release);
+                }
+            }
+            else if (Ptr<U> strong = other.lock()) {
+                T* ptr = strong.get();
+                counted(ptr)->gc_add_weak();
+                bits_.store(pack(ptr, true), std::memory_order_release);
+            }
+            track();
+        }
+
+        // Upcast taking over `other`'s strong reference.
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        Ptr(Ptr<U>&& other) noexcept : bits_(0) {
+            if (other.is_weak()) {
+                Ptr tmp(other);
+                swap(tmp);
+                other.reset();
+                return;
+            }
+            T* ptr = Ptr<U>::object_of(other.bits_.exchange(0, std::memory_order_acq_rel));
+            bits_.store(pack(ptr, false), std::memory_order_release);
+            track();
+            other.track();
+        }
+
+        ~Ptr() {
+            release();
+#ifdef GC_LEAK_DETECTOR
+            detail::leak_on_slot(this, nullptr);
+#endif
+        }
+
+        Ptr& operator=(const Ptr& other) noexcept {
+            if (this != &other) {
+                Ptr tmp(other);
+                swap(tmp);
+            }
+            return *this;
+        }
+
+        Ptr& operator=(Ptr&& other) noexcept {
+            if (this != &other) {
+                release();
+                bits_.store(other.bits_.exchange(0, std::memory_order_acq_rel), std::memory_order_release);
+                track();
+                other.track();
+            }
+            return *this;
+        }
+
+        Ptr& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        Ptr safe(const Ptr& strong_ref) const {
+            uintptr_t bits = strong_ref.bits_.load(std::memory_order_acquire);
+            T* ptr = object_of(bits);
+            if (!ptr || is_weak_bits(bits)) {
+                return Ptr();
+            }
+            counted(ptr)->gc_add_weak();
+            return Ptr(ptr, true);
+        }
+
+        Ptr lock() const {
+            uintptr_t bits = bits_.load(std::memory_order_acquire);
+            T* ptr = object_of(bits);
+            if (!is_weak_bits(bits) || !ptr) {
+                return Ptr(*this);
+            }
+            if (counted(ptr)->gc_try_add_strong()) {
+                return Ptr(ptr, false);
+            }
+            return Ptr();
+        }
+
+        void Ref(const Ptr& other) {
+            if (this == &other) return;
+            release();
+
+            uintptr_t bits = other.bits_.load(std::memory_order_acquire);
+            T* ptr = object_of(bits);
+            if (ptr && !is_weak_bits(bits)) {
+                counted(ptr)->gc_add_weak();
+                bits_.store(pack(ptr, true), std::memory_order_release);
+            }
+            else {
+                bits_.store(0, std::memory_order_release);
+            }
+            track();
+        }
+
+        bool expired() const noexcept {
+            T* ptr = object_of(bits_.load(std::memory_order_acquire));
+            return !ptr || counted(ptr)->gc_strong_count() == 0;
+        }
+
+        T* get() const noexcept {
+            uintptr_t bits = bits_.load(std::memory_order_acquire);
+            return is_weak_bits(bits) ? nullptr : object_of(bits);
+        }
+
+        T& operator*() const noexcept {
+            T* ptr = get();
+            assert(ptr && "Dereferencing null");
+            return *ptr;
+        }
+
+        T* operator->() const noexcept {
+            T* ptr = get();
+            assert(ptr && "Accessing through null");
+            return ptr;
+        }
+
+        explicit operator bool() const noexcept {
+            if (is_weak()) {
+                return !expired();
+            }
+            return get() != nullptr;
+        }
+
+        size_t ref_count() const noexcept {
+            T* ptr = object_of(bits_.load(std::memory_order_acquire));
+            return ptr ? counted(ptr)->gc_strong_count() : 0;
+        }
+
+        size_t weak_count() const noexcept {
+            T* ptr = object_of(bits_.load(std::memory_order_acquire));
+            return ptr ? counted(ptr)->gc_weak_count() : 0;
+        }
+
+        bool unique() const noexcept {
+            return ref_count() == 1;
+        }
+
+        bool is_weak() const noexcept {
+            return is_weak_bits(bits_.load(std::memory_order_acquire));
+        }
+
+        void reset() noexcept {
+            release();
+            bits_.store(0, std::memory_order_release);
+            track();
+        }
+
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        void reset(U* ptr) {
+            Ptr tmp(ptr);
+            swap(tmp);
+        }
+
+        void swap(Ptr& other) noexcept {
+            uintptr_t mine = bits_.exchange(other.bits_.load(std::memory_order_acquire), std::memory_order_acq_rel);
+            other.bits_.store(mine, std::memory_order_release);
+            track();
+            other.track();
+        }
+
+        bool operator==(const Ptr& other) const noexcept {
+            return get() == other.get();
+        }
+
+        bool operator!=(const Ptr& other) const noexcept {
+            return !(*this == other);
+        }
+
+        bool operator==(std::nullptr_t) const noexcept {
+            return get() == nullptr;
+        }
+
+        bool operator!=(std::nullptr_t) const noexcept {
+            return get() != nullptr;
+        }
+
+    private:
+        // The object must start its allocation, which is what gets freed.
+        template<typename U>
+        static void check_adoptable(U* ptr) noexcept {
+            static_assert(alignof(U) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                "over-aligned RefCounted types are not supported");
+            if constexpr (std::is_polymorphic_v<U>) {
+                assert(dynamic_cast<const void*>(ptr) == counted(ptr)->gc_memory() &&
+                    "RefCounted base must be at the start of the object");
+            }
+            (void)ptr;
+        }
+
+        // First reference to an object new_ref_counted has just made; it
+        // registers the block with the leak detector itself, with its site.
+        void adopt_new(T* ptr) noexcept {
+            check_adoptable(ptr);
+            counted(ptr)->gc_add_strong();
+            bits_.store(pack(ptr, false), std::memory_order_release);
+            track();
+        }
+
+        void track() noexcept {
+#ifdef GC_LEAK_DETECTOR
+            uintptr_t bits = bits_.load(std::memory_order_acquire);
+            T* ptr = object_of(bits);
+            detail::leak_on_slot(this, (ptr && !is_weak_bits(bits)) ? counted(ptr) : nullptr);
+#endif
+        }
+
+        void release() noexcept {
+            uintptr_t bits = bits_.load(std::memory_order_acquire);
+            if (T* ptr = object_of(bits)) {
+                if (is_weak_bits(bits)) {
+                    counted(ptr)->gc_release_weak();
+                }
+                else {
+                    counted(ptr)->gc_release_strong();
+                }
+            }
+        }
+    };
+
+    // Equivalents of std::static_pointer_cast and friends. The result shares
+    // ownership with `p`; a weak `p` gives a weak result (empty once expired).
+    // Like a copy, a cast must not race with replace() on `p`: cast the
+    // Ptr from protect().lock() instead.
+    template<typename T, typename U>
+    Ptr<T> static_pointer_cast(const Ptr<U>& p) noexcept {
+        if (p.is_weak()) {
+            Ptr<T> weak;
+            weak.Ref(static_pointer_cast<T>(p.lock()));
+            return weak;
+        }
+        return Ptr<T>(p, static_cast<T*>(p.get()));
+    }
+
+    // Empty if the object is not a T.
+    template<typename T, typename U>
+    Ptr<T> dynamic_pointer_cast(const Ptr<U>& p) noexcept {
+        if (p.is_weak()) {
+            Ptr<T> weak;
+            weak.Ref(dynamic_pointer_cast<T>(p.lock()));
+            return weak;
+        }
+        T* ptr = dynamic_cast<T*>(p.get());
+        return ptr ? Ptr<T>(p, ptr) : Ptr<T>();
+    }
+
+    template<typename T, typename U>
+    Ptr<T> const_pointer_cast(const Ptr<U>& p) noexcept {
+        if (p.is_weak()) {
+            Ptr<T> weak;
+            weak.Ref(const_pointer_cast<T>(p.lock()));
+            return weak;
+        }
+        return Ptr<T>(p, const_cast<T*>(p.get()));
+    }
+
+    namespace detail {
+
+        // Block for NewArray: the header is followed directly by the
+        // elements in the same allocation, taken from the GC heap like
+        // New's blocks.
+        template<typename T>
+        class ArrayBlock final : public ControlBlock<T> {
+        public:
+            static constexpr size_t kAlign = alignof(T) > alignof(ControlBlock<T>) ? alignof(T) : alignof(ControlBlock<T>);
+
+            static constexpr size_t header_size() noexcept {
+                return (sizeof(ArrayBlock) + alignof(T) - 1) / alignof(T) * alignof(T);
+            }
+
+            template<bool ValueInit>
+            static ArrayBlock* create(size_t n) {
+                if (n > (static_cast<size_t>(-1) - header_size()) / sizeof(T)) {
+                    throw std::bad_array_new_length();
+                }
+                char* mem = static_cast<char*>(heap_allocate(header_size() + n * sizeof(T), kAlign));
+                T* elems = reinterpret_cast<T*>(mem + header_size());
+                size_t built = 0;
+                try {
+                    if constexpr (ValueInit) {
+                        for (; built < n; ++built) {
+                            ::new (static_cast<void*>(elems + built)) T();
+                        }
+                    }
+                    else if constexpr (!std::is_trivially_default_constructible_v<T>) {
+                        for (; built < n; ++built) {
+                            ::new (static_cast<void*>(elems + built)) T;
+                        }
+                    }
+                }
+                catch (...) {
+                    destroy_elements(elems, built);
+                    heap_free(mem, header_size() + n * sizeof(T), kAlign);
+                    throw;
+                }
+                return ::new (static_cast<void*>(mem)) ArrayBlock(elems, n);
+            }
+
+            T* elements() noexcept {
+                return reinterpret_cast<T*>(reinterpret_cast<char*>(this) + header_size());
+            }
+
+        protected:
+            void dispose() noexcept override {
+                destroy_elements(elements(), size_);
+            }
+
+            void destroy() noexcept override {
+                size_t bytes = header_size() + size_ * sizeof(T);
+                this->~ArrayBlock();
+                heap_free(this, bytes, kAlign);
+            }
+
+        private:
+            ArrayBlock(T* elems, size_t n) noexcept : size_(n) {
+                leak_on_block(this, elems, AllocSite{ nullptr, 0 }, n);
+            }
+
+            static void destroy_elements(T* p, size_t n) noexcept {
+                if constexpr (!std::is_trivially_destructible_v<T>) {
+                    while (n > 0) {
+                        p[--n].~T();
+                    }
+                }
+            }
+
+            size_t size_;
+        };
+    }
+
+    // Shared array: same ownership rules as Ptr<T>, plus element access and
+    // the element count.
+    template<typename T>
+    class Ptr<T[]> {
+    private:
+        Ptr<T> elems_;
+        size_t size_;
+
+        Ptr(Ptr<T> elems, size_t n) noexcept : elems_(std::move(elems)), size_(n) {}
+
+        template<typename, typename> friend class Ptr;
+        friend struct detail::PtrAccess;
+
+    public:
+        using element_type = T;
+
+        constexpr Ptr() noexcept : elems_(), size_(0) {}
+        constexpr Ptr(std::nullptr_t) noexcept : elems_(), size_(0) {}
+
+        // Takes ownership of `new T[n]`.
+        Ptr(T* ptr, size_t n) : elems_(ptr, std::default_delete<T[]>()), size_(ptr ? n : 0) {}
+
+        template<typename D>
+        Ptr(T* ptr, size_t n, D deleter) : elems_(ptr, std::move(deleter)), size_(ptr ? n : 0) {}
+
+        Ptr(const Ptr&) = default;
+
+        Ptr(Ptr&& other) noexcept : elems_(std::move(other.elems_)), size_(other.size_) {
+            other.size_ = 0;
+        }
+
+        Ptr& operator=(const Ptr& other) noexcept {
+            if (this != &other) {
+                elems_ = other.elems_;
+                size_ = other.size_;
+            }
+            return *this;
+        }
+
+        Ptr& operator=(Ptr&& other) noexcept {
+            if (this != &other) {
+                elems_ = std::move(other.elems_);
+                size_ = other.size_;
+                other.size_ = 0;
+            }
+            return *this;
+        }
+
+        Ptr& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        Ptr safe(const Ptr& strong_ref) const {
+            Ptr<T> weak = elems_.safe(strong_ref.elems_);
+            return weak.is_weak() ? Ptr(std::move(weak), strong_ref.size_) : Ptr();
+        }
+
+        Ptr lock() const {
+            Ptr<T> strong = elems_.lock();
+            return strong ? Ptr(std::move(strong), size_) : Ptr();
+        }
+
+        void Ref(const Ptr& other) {
+            if (this == &other) return;
+            elems_.Ref(other.elems_);
+            size_ = elems_.is_weak() ? other.size_ : 0;
+        }
+
+        T& operator[](size_t i) const noexcept {
+            assert(i < size_ && "Array index out of range");
+            return elems_.get()[i];
+        }
+
+        T* get() const noexcept { return elems_.get(); }
+        T* begin() const noexcept { return get(); }
+        T* end() const noexcept { T* p = get(); return p ? p + size_ : p; }
+        size_t size() const noexcept { return size_; }
+
+        bool expired() const noexcept { return elems_.expired(); }
+        explicit operator bool() const noexcept { return static_cast<bool>(elems_); }
+        size_t ref_count() const noexcept { return elems_.ref_count(); }
+        size_t weak_count() const noexcept { return elems_.weak_count(); }
+        bool unique() const noexcept { return elems_.unique(); }
+        bool is_weak() const noexcept { return elems_.is_weak(); }
+
+        void reset() noexcept {
+            elems_.reset();
+            size_ = 0;
+        }
+
+        void swap(Ptr& other) noexcept {
+            elems_.swap(other.elems_);
+            std::swap(size_, other.size_);
+        }
+
+        bool operator==(const Ptr& other) const noexcept { return elems_ == other.elems_; }
+        bool operator!=(const Ptr& other) const noexcept { return elems_ != other.elems_; }
+        bool operator==(std::nullptr_t) const noexcept { return elems_ == nullptr; }
+        bool operator!=(std::nullptr_t) const noexcept { return elems_ != nullptr; }
+    };
+
+    // n value-initialized elements (zeroed for arithmetic types), stored in
+    // the same allocation as the control block.
+    template<typename T>
+    Ptr<T[]> NewArray(size_t n) {
+        static_assert(!std::is_array_v<T>, "NewArray<T>: pass the element type");
+        auto* block = detail::ArrayBlock<T>::template create<true>(n);
+        return detail::PtrAccess::adopt_array<T>(block, block->elements(), n);
+    }
+
+    // n default-initialized elements: trivially constructible types are
+    // left uninitialized, which avoids touching large numeric buffers twice.
+    template<typename T>
+    Ptr<T[]> NewArrayForOverwrite(size_t n) {
+        static_assert(!std::is_array_v<T>, "NewArrayForOverwrite<T>: pass the element type");
+        auto* block = detail::ArrayBlock<T>::template create<false>(n);
+        return detail::PtrAccess::adopt_array<T>(block, block->elements(), n);
+    }
+
+    // Uncounted reference for stack locals and by-value parameters, valid
+    // under enable_deferred_rc(): creating, copying and destroying one never
+    // touches the shared counters, and a block it names is not finalized
+    // before this thread's next reconcile(). Must stay on the thread that
+    // created it.
+    template<typename T>
+    class StackRef {
+    public:
+        StackRef() noexcept : ctrl_(nullptr), ptr_(nullptr), slot_(kNoSlot) {}
+
+        StackRef(const Ptr<T>& p)
+            : ctrl_(detail::PtrAccess::strong_ctrl(p)), ptr_(ctrl_ ? p.get() : nullptr), slot_(kNoSlot) {
+            assert((!ctrl_ || detail::deferred_rc_active()) && "StackRef requires GC::enable_deferred_rc()");
+            if (ctrl_) {
+                slot_ = detail::stack_ref_push(ctrl_);
+            }
+        }
+
+        StackRef(const StackRef& other) : ctrl_(other.ctrl_), ptr_(other.ptr_), slot_(kNoSlot) {
+            if (ctrl_) {
+                slot_ = detail::stack_ref_push(ctrl_);
+            }
+        }
+
+        StackRef& operator=(const StackRef& other) {
+            if (this != &other) {
+                StackRef tmp(other);
+                std::swap(ctrl_, tmp.ctrl_);
+                std::swap(ptr_, tmp.ptr_);
+                std::swap(slot_, tmp.slot_);
+            }
+            return *this;
+        }
+
+        ~StackRef() {
+            if (slot_ != kNoSlot) {
+                detail::stack_ref_pop(slot_);
+            }
+        }
+
+        T* get() const noexcept {
+            return ptr_;
+        }
+
+        T& operator*() const noexcept {
+            assert(ptr_ && "Dereferencing null");
+            return *ptr_;
+        }
+
+        T* operator->() const noexcept {
+            assert(ptr_ && "Accessing through null");
+            return ptr_;
+        }
+
+        explicit operator bool() const noexcept {
+            return ptr_ != nullptr;
+        }
+
+        // Counted copy, e.g. to store the reference in the heap. Revives a
+        // block that is waiting in the zero-count table.
+        Ptr<T> to_ptr() const noexcept {
+            if (!ctrl_) {
+                return Ptr<T>();
+            }
+            // Direct increment: reconcile() must see it even when counts
+            // are being coalesced.
+            ctrl_->apply_strong_delta(1);
+            return detail::PtrAccess::adopt<T>(ctrl_, ptr_);
+        }
+
+    private:
+        static constexpr size_t kNoSlot = static_cast<size_t>(-1);
+
+        ControlBlock<T>* ctrl_;
+        T* ptr_;
+        size_t slot_;
+    };
+
+    // Like std::allocate_shared: one allocation from `alloc` holds both the
+    // object and its control block.
+    template<typename T, typename A, typename... Args>
+    Ptr<T> allocate(const A& alloc, Args&&... args) {
+        return detail::allocate_at<T>(AllocSite{ nullptr, 0 }, alloc, std::forward<Args>(args)...);
+    }
+
+    namespace detail {
+
+        // A RefCounted object is its own control block: plain global new,
+        // since it may also be adopted from a plain `new` and is freed
+        // without its size. It is not counted in heap_usage() and does not
+        // feed the heap limit or the pacer.
+        template<typename T, typename... Args>
+        Ptr<T> new_ref_counted(AllocSite site, Args&&... args) {
+            safepoint_poll();
+            Ptr<T> p = PtrAccess::adopt_new(::new T(std::forward<Args>(args)...));
+            leak_on_block(static_cast<const typename T::gc_ref_counted*>(p.get()), p.get(), site);
+            return p;
+        }
+    }
+
+    // Object and block share one allocation from the calling thread's heap
+    // (see PoolAllocator).
+    template<typename T, typename... Args>
+    Ptr<T> New(Args&&... args) {
+        if constexpr (is_ref_counted<T>::value) {
+            return detail::new_ref_counted<T>(AllocSite{ nullptr, 0 }, std::forward<Args>(args)...);
+        }
+        else {
+            return detail::allocate_at<T>(AllocSite{ nullptr, 0 }, PoolAllocator<T>(), std::forward<Args>(args)...);
+        }
+    }
+
+    // Same as New, but records the allocation site for the leak detector.
+    template<typename T, typename... Args>
+    Ptr<T> NewAt(AllocSite site, Args&&... args) {
+        if constexpr (is_ref_counted<T>::value) {
+            return detail::new_ref_counted<T>(site, std::forward<Args>(args)...);
+        }
+        else {
+            return detail::allocate_at<T>(site, PoolAllocator<T>(), std::forward<Args>(args)...);
+        }
+    }
+
+    // Same as New, but the object and its block come from pages placed on
+    // NUMA node `node` (the caller's own node if out of range). Objects the
+    // constructor allocates with New land there too. RefCounted and large
+    // objects are not placed.
+    template<typename T, typename... Args>
+    Ptr<T> New_on_node(int node, Args&&... args) {
+        NodeScope scope(node);
+        return New<T>(std::forward<Args>(args)...);
+    }
+
+    namespace detail {
+
+        template<typename T>
+        struct is_ptr : std::false_type {};
+
+        template<typename T, typename E>
+        struct is_ptr<Ptr<T, E>> : std::true_type {};
+
+        // Declared in Cpp_Leak.hpp, which needs it first.
+        template<typename T, typename>
+        struct is_traceable_impl : std::false_type {};
+
+        // Only the class that wrote GC_TRACE; a derived class without its
+        // own would silently skip its members.
+        template<typename T>
+        struct is_traceable_impl<T, std::void_t<typename T::gc_traced_type>>
+            : std::is_same<typename T::gc_traced_type, T> {};
+
+        template<typename T, typename = void>
+        struct is_range : std::false_type {};
+
+        template<typename T>
+        struct is_range<T, std::void_t<decltype(std::begin(std::declval<T&>())), decltype(std::end(std::declval<T&>()))>>
+            : std::true_type {};
+
+        template<typename T>
+        struct dependent_false : std::false_type {};
+
+        template<typename Visitor, typename M>
+        constexpr void trace_member(Visitor& visit, M& member) {
+            using Bare = std::remove_cv_t<M>;
+            if constexpr (is_ptr<Bare>::value) {
+                visit(member);
+            }
+            else if constexpr (is_traceable_impl<Bare>::value) {
+                member.gc_trace(visit);
+            }
+            else if constexpr (is_range<M>::value) {
+                for (auto& element : member) {
+                    trace_member(visit, element);
+                }
+            }
+            else {
+                static_assert(dependent_false<M>::value,
+                    "GC_TRACE members must be GC::Ptrs, GC_TRACE'd objects or ranges of them");
+            }
+        }
+
+        template<typename Visitor, typename... M>
+        constexpr void trace_members(Visitor& visit, M&... members) {
+            (trace_member(visit, members), ...);
+        }
+    }
+
+    // True for classes that list their Ptr members with GC_TRACE.
+    template<typename T>
+    struct is_traceable : detail::is_traceable_impl<std::remove_cv_t<T>> {};
+
+    // Calls visit(ptr) for every Ptr that `obj` lists in GC_TRACE, looking
+    // through nested traced members and ranges, in declaration order of
+    // the list. Everything is resolved at compile time.
+    template<typename T, typename Visitor>
+    constexpr void trace(T& obj, Visitor&& visit) {
+        static_assert(is_traceable<T>::value, "T has no GC_TRACE");
+        obj.gc_trace(visit);
+    }
+
+    // Number of members T lists in GC_TRACE.
+    template<typename T>
+    constexpr size_t trace_member_count() noexcept {
+        static_assert(is_traceable<T>::value, "T has no GC_TRACE");
+        return T::gc_trace_count();
+    }
+
+#define GC_REF(ptr, member, value) (ptr)->member.Ref(value)
+
+// Inside the class body: lists the members a collector has to follow.
+//   struct Node { int v; GC::Ptr<Node> left, right; GC_TRACE(Node, left, right) };
+#define GC_TRACE(Type, ...) \
+    using gc_traced_type = Type; \
+    template<typename GcVisitor> \
+    constexpr void gc_trace(GcVisitor& visit) { \
+        static_assert(::std::is_same<Type, ::std::remove_pointer_t<decltype(this)>>::value, \
+            "GC_TRACE must name the class it is in"); \
+        ::GC::detail::trace_members(visit, __VA_ARGS__); \
+    } \
+    template<typename GcVisitor> \
+    constexpr void gc_trace(GcVisitor& visit) const { \
+        static_assert(::std::is_same<Type, ::std::remove_cv_t<::std::remove_pointer_t<decltype(this)>>>::value, \
+            "GC_TRACE must name the class it is in"); \
+        ::GC::detail::trace_members(visit, __VA_ARGS__); \
+    } \
+    static constexpr ::std::size_t gc_trace_count() noexcept { \
+        return ::std::tuple_size<decltype(::std::forward_as_tuple(__VA_ARGS__))>::value; \
+    }
+
+#define GC_NEW(T, ...) ::GC::NewAt<T>(::GC::AllocSite{ __FILE__, __LINE__ }, ##__VA_ARGS__)
 
 }
 
@@ -0,0 +1,384 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "Cpp_Ptr.hpp"
+
+namespace GC {
+
+    class RefVisitor;
+
+    // A Ptr met during a root scan, with its static type erased: what it
+    // points to and, if the element type has GC_TRACE, how to reach the
+    // Ptrs inside.
+    struct TracedRef {
+        const void* object = nullptr;
+        size_t count = 0;          // elements, for Ptr<T[]>
+        bool weak = false;
+        void (*trace_fn)(const void* object, size_t count, const RefVisitor& visit) = nullptr;
+
+        bool traceable() const noexcept {
+            return trace_fn != nullptr;
+        }
+
+        // Calls visit(ref) for every non-null Ptr the object lists in
+        // GC_TRACE (every element's, for arrays).
+        template<typename F>
+        void children(F&& visit) const;
+    };
+
+    // Non-owning callable reference taking a TracedRef; what the erased
+    // trace functions call back into.
+    class RefVisitor {
+    public:
+        template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, RefVisitor>::value>>
+        RefVisitor(F& f) noexcept
+            : ctx_(const_cast<void*>(static_cast<const void*>(&f))),
+              fn_([](void* ctx, const TracedRef& ref) { (*static_cast<F*>(ctx))(ref); }) {
+        }
+
+        void operator()(const TracedRef& ref) const {
+            fn_(ctx_, ref);
+        }
+
+    private:
+        void* ctx_;
+        void (*fn_)(void*, const TracedRef&);
+    };
+
+    namespace detail {
+
+        template<typename E>
+        void trace_elements(const void* object, size_t count, const RefVisitor& visit);
+
+        template<typename P>
+        struct is_array_ptr : std::false_type {};
+
+        template<typename T>
+        struct is_array_ptr<Ptr<T[], void>> : std::true_type {};
+
+        template<typename P>
+        TracedRef traced_ref(const P& p) noexcept {
+            using Element = std::remove_cv_t<typename P::element_type>;
+            TracedRef ref;
+            ref.object = static_cast<const void*>(p.get());
+            ref.weak = p.is_weak();
+            if constexpr (is_array_ptr<P>::value) {
+                ref.count = p.size();
+            }
+            else {
+                ref.count = ref.object ? 1 : 0;
+            }
+            if constexpr (is_traceable_impl<Element>::value) {
+                ref.trace_fn = &trace_elements<Element>;
+            }
+            return ref;
+        }
+
+        template<typename E>
+        void trace_elements(const void* object, size_t count, const RefVisitor& visit) {
+            auto each = [&](const auto& ptr) {
+                if (ptr) {
+                    visit(traced_ref(ptr));
+                }
+            };
+            const E* elems = static_cast<const E*>(object);
+            for (size_t i = 0; i < count; ++i) {
+                elems[i].gc_trace(each);
+            }
+        }
+
+        class RootList;
+
+        // Links of a Root inside its thread's list. `list` is where it was
+        // linked, so a Root destroyed on another thread (a global at exit)
+        // still unlinks from the right one.
+        struct RootNode {
+            RootNode* prev = nullptr;
+            RootNode* next = nullptr;
+            RootList* list = nullptr;
+            void (*scan)(const RootNode*, const RefVisitor&) = nullptr;
+        };
+
+        // Doubly linked, so Roots may die in any order. Only its own thread
+        // links into it; the lock is uncontended except while a collector
+        // scans this list (or a Root from another thread unlinks).
+        class alignas(kCacheLine) RootList {
+        public:
+            RootList() {
+                head_.prev = &head_;
+                head_.next = &head_;
+            }
+
+            void lock() noexcept {
+                while (busy_.exchange(true, std::memory_order_acquire)) {
+                    while (busy_.load(std::memory_order_relaxed)) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+
+            void unlock() noexcept {
+                busy_.store(false, std::memory_order_release);
+            }
+
+            void push(RootNode* node) noexcept {
+                lock();
+                node->list = this;
+                node->prev = &head_;
+                node->next = head_.next;
+                head_.next->prev = node;
+                head_.next = node;
+                unlock();
+            }
+
+            void remove(RootNode* node) noexcept {
+                lock();
+                node->prev->next = node->next;
+                node->next->prev = node->prev;
+                unlock();
+            }
+
+            // Caller holds the lock.
+            template<typename F>
+            void for_each(F&& f) const {
+                for (const RootNode* n = head_.next; n != &head_; n = n->next) {
+                    f(n);
+                }
+            }
+
+            std::atomic<bool> in_use{ true };
+            RootList* next_list = nullptr;
+
+        private:
+            std::atomic<bool> busy_{ false };
+            RootNode head_;
+        };
+
+        // Every RootList ever made. Lists are never freed: an exited thread's
+        // list is handed to the next thread, with whatever Roots are still
+        // linked into it.
+        class RootRegistry {
+        public:
+            static RootRegistry& instance() {
+                static RootRegistry* reg = new RootRegistry();
+                return *reg;
+            }
+
+            RootList* acquire() {
+                for (RootList* l = lists_.load(std::memory_order_acquire); l; l = l->next_list) {
+                    bool free = false;
+                    if (!l->in_use.load(std::memory_order_relaxed) &&
+                        l->in_use.compare_exchange_strong(free, true, std::memory_order_acquire)) {
+                        return l;
+                    }
+                }
+                auto* list = new RootList();
+                list->next_list = lists_.load(std::memory_order_relaxed);
+                while (!lists_.compare_exchange_weak(list->next_list, list,
+                    std::memory_order_release, std::memory_order_relaxed)) {
+                }
+                return list;
+            }
+
+            // For Roots made while their thread is being torn down.
+            RootList* shared() {
+                static RootList* list = acquire();
+                return list;
+            }
+
+            RootList* first() const noexcept {
+                return lists_.load(std::memory_order_acquire);
+            }
+
+        private:
+            std::atomic<RootList*> lists_{ nullptr };
+        };
+
+        // Caller holds the list's lock.
+        inline void scan_root_list(const RootList& list, const RefVisitor& visit) {
+            list.for_each([&](const RootNode* node) {
+                node->scan(node, visit);
+            });
+        }
+
+        struct RootThreadList {
+            RootList* list = nullptr;
+
+            ~RootThreadList();
+        };
+
+        inline thread_local RootThreadList root_thread_list;
+        inline thread_local bool root_thread_list_dead = false;
+
+        inline RootThreadList::~RootThreadList() {
+            root_thread_list_dead = true;
+            if (list) {
+                list->in_use.store(false, std::memory_order_release);
+            }
+        }
+
+        inline RootList* local_root_list() {
+            if (root_thread_list_dead) {
+                return RootRegistry::instance().shared();
+            }
+            RootList*& list = root_thread_list.list;
+            if (!list) {
+                list = RootRegistry::instance().acquire();
+            }
+            return list;
+        }
+    }
+
+    template<typename F>
+    void TracedRef::children(F&& visit) const {
+        if (trace_fn) {
+            RefVisitor v(visit);
+            trace_fn(object, count, v);
+        }
+    }
+
+    // A Ptr that a tracing pass starts from. Make Roots on the stack or in
+    // globals for the references a thread holds outside managed objects;
+    // each one is linked into its thread's root list on construction and
+    // unlinked on destruction (O(1) both ways). The Root owns a strong
+    // reference like any Ptr.
+    //
+    // The held Ptr is changed only through the Root (assignment, reset),
+    // under the list's lock, so a scan on another thread sees either value
+    // and the object it reports stays alive until the scan is done with it.
+    template<typename T>
+    class Root : private detail::RootNode {
+    public:
+        using element_type = typename Ptr<T>::element_type;
+
+        Root() {
+            link();
+        }
+
+        Root(Ptr<T> p) : ptr_(std::move(p)) {
+            link();
+        }
+
+        Root(const Root& other) : ptr_(other.ptr_) {
+            link();
+        }
+
+        Root(Root&& other) : ptr_(other.take()) {
+            link();
+        }
+
+        ~Root() {
+            list->remove(this);
+        }
+
+        Root& operator=(const Root& other) {
+            if (this != &other) {
+                set(other.ptr_);
+            }
+            return *this;
+        }
+
+        Root& operator=(Root&& other) {
+            if (this != &other) {
+                set(other.take());
+            }
+            return *this;
+        }
+
+        Root& operator=(Ptr<T> p) {
+            set(std::move(p));
+            return *this;
+        }
+
+        void reset() {
+            set(Ptr<T>());
+        }
+
+        const Ptr<T>& ptr() const noexcept {
+            return ptr_;
+        }
+
+        operator const Ptr<T>&() const noexcept {
+            return ptr_;
+        }
+
+        element_type* get() const noexcept {
+            return ptr_.get();
+        }
+
+        element_type* operator->() const noexcept {
+            return ptr_.get();
+        }
+
+        element_type& operator*() const noexcept {
+            return *ptr_.get();
+        }
+
+        explicit operator bool() const noexcept {
+            return static_cast<bool>(ptr_);
+        }
+
+    private:
+        void link() {
+            scan = &scan_root;
+            detail::local_root_list()->push(this);
+        }
+
+        // The previous target is released after the lock is dropped: its
+        // destructor may make or destroy Roots.
+        void set(Ptr<T> value) {
+            Ptr<T> old;
+            list->lock();
+            old = std::move(ptr_);
+            ptr_ = std::move(value);
+            list->unlock();
+        }
+
+        Ptr<T> take() {
+            Ptr<T> out;
+            list->lock();
+            out = std::move(ptr_);
+            list->unlock();
+            return out;
+        }
+
+        static void scan_root(const detail::RootNode* node, const RefVisitor& visit) {
+            const Ptr<T>& p = static_cast<const Root*>(node)->ptr_;
+            if (p) {
+                visit(detail::traced_ref(p));
+            }
+        }
+
+        Ptr<T> ptr_;
+    };
+
+    // Calls visit(ref) for the target of every non-null Root of every
+    // thread. Threads are scanned one at a time, each with its root list
+    // locked: a thread is held up only if it makes, destroys or assigns a
+    // Root while its own list is being scanned. `visit` must not touch
+    // Roots itself. Objects reached through ref.children() are only as
+    // stable as the graph: mutators changing their Ptrs race with the scan.
+    template<typename F>
+    void scan_roots(F&& visit) {
+        RefVisitor v(visit);
+        for (detail::RootList* l = detail::RootRegistry::instance().first(); l; l = l->next_list) {
+            l->lock();
+            detail::scan_root_list(*l, v);
+            l->unlock();
+        }
+    }
+
+    // Non-null Roots across all threads.
+    inline size_t root_count() {
+        size_t n = 0;
+        scan_roots([&](const TracedRef&) { ++n; });
+        return n;
+    }
+
+}
@@ -0,0 +1,386 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Cpp_Coalesce.hpp"
+#include "Cpp_Heap.hpp"
+#include "Cpp_Root.hpp"
+#include "Cpp_Stats.hpp"
+
+namespace GC {
+
+    class ThreadState;
+
+    namespace detail {
+
+        // One handshake request, shared by every thread it was posted to.
+        struct HandshakeOp {
+            std::function<void(ThreadState&)> action;
+            uint64_t start = 0;   // 0 when stats are off
+            std::mutex mtx;
+            std::condition_variable cv;
+            size_t remaining = 0;
+
+            void complete() {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (--remaining == 0) {
+                    if (start) {
+                        stats_state().histograms[static_cast<size_t>(Metric::HandshakeTime)].record(now_ns() - start);
+                    }
+                    cv.notify_all();
+                }
+            }
+        };
+
+        using HandshakeOps = std::vector<std::shared_ptr<HandshakeOp>>;
+
+        class ThreadRegistry;
+        struct ThreadAccess;
+    }
+
+    // State block of an attached thread: what a handshake action gets, on
+    // the thread itself at a safepoint or on the requesting thread while
+    // the owner is inside a BlockingScope. Either way the owner is stopped
+    // at a known point for the duration of the action.
+    class ThreadState {
+    public:
+        ThreadState(const ThreadState&) = delete;
+        ThreadState& operator=(const ThreadState&) = delete;
+
+        std::thread::id id() const noexcept {
+            return id_;
+        }
+
+        // False when the action runs on behalf of a blocked thread.
+        bool on_own_thread() const noexcept {
+            return std::this_thread::get_id() == id_;
+        }
+
+        // Publishes the thread's coalesced count buffer (see flush_counts).
+        size_t flush_counts() noexcept {
+            return detail::flush_count_buffer(*counts_);
+        }
+
+        // Calls visit(ref) for the target of each of the thread's Roots.
+        template<typename F>
+        void scan_roots(F&& visit) {
+            RefVisitor v(visit);
+            roots_->lock();
+            detail::scan_root_list(*roots_, v);
+            roots_->unlock();
+        }
+
+    private:
+        friend class detail::ThreadRegistry;
+        friend struct detail::ThreadAccess;
+
+        // kBlocked: inside a BlockingScope. kClaimed: a requester is running
+        // actions for it; the owner waits before leaving the scope.
+        enum Mode : int { kRunning, kBlocked, kClaimed };
+
+        ThreadState()
+            : id_(std::this_thread::get_id()),
+              roots_(detail::local_root_list()),
+              counts_(&detail::count_buffer) {
+        }
+
+        void post(std::shared_ptr<detail::HandshakeOp> op) {
+            std::lock_guard<std::mutex> lock(ops_mtx_);
+            ops_.push_back(std::move(op));
+            if (!armed_.load(std::memory_order_relaxed)) {
+                armed_.store(true, std::memory_order_seq_cst);
+                detail::handshakes_pending.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        detail::HandshakeOps take() {
+            detail::HandshakeOps ops;
+            std::lock_guard<std::mutex> lock(ops_mtx_);
+            ops.swap(ops_);
+            if (armed_.load(std::memory_order_relaxed)) {
+                armed_.store(false, std::memory_order_relaxed);
+                detail::handshakes_pending.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return ops;
+        }
+
+        // Actions are best effort: one that throws still counts as done.
+        void run_ops() {
+            for (const auto& op : take()) {
+                try {
+                    op->action(*this);
+                }
+                catch (...) {
+                }
+                op->complete();
+            }
+        }
+
+        bool claim() noexcept {
+            int blocked = kBlocked;
+            return mode_.compare_exchange_strong(blocked, kClaimed, std::memory_order_seq_cst);
+        }
+
+        std::thread::id id_;
+        detail::RootList* roots_;
+        detail::CountBuffer* counts_;
+        std::atomic<int> mode_{ kRunning };
+        std::atomic<bool> armed_{ false };
+        std::mutex ops_mtx_;
+        detail::HandshakeOps ops_;
+        unsigned attach_depth_ = 0;
+        unsigned blocking_depth_ = 0;
+        bool running_ops_ = false;
+    };
+
+    namespace detail {
+
+        inline thread_local ThreadState* thread_state = nullptr;
+
+        // Attached threads. Requests are serialized so that only one
+        // requester ever claims a blocked thread.
+        class ThreadRegistry {
+        public:
+            static ThreadRegistry& instance() {
+                static ThreadRegistry* reg = new ThreadRegistry();
+                return *reg;
+            }
+
+            void attach() {
+                ThreadState*& self = thread_state;
+                if (self) {
+                    ++self->attach_depth_;
+                    return;
+                }
+                self = new ThreadState();
+                self->attach_depth_ = 1;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    threads_.push_back(self);
+                }
+                poll_handler = &poll;
+            }
+
+            // Runs whatever was posted before the thread left the registry,
+            // so no handshake waits on it afterwards.
+            void detach() {
+                ThreadState* self = thread_state;
+                if (!self || --self->attach_depth_ > 0) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    threads_.erase(std::remove(threads_.begin(), threads_.end(), self), threads_.end());
+                }
+                poll_handler = nullptr;
+                self->run_ops();
+                thread_state = nullptr;
+                delete self;
+            }
+
+            size_t size() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                return threads_.size();
+            }
+
+            // Posts `op` to every attached thread and runs it right away for
+            // the ones inside a BlockingScope (and for the caller).
+            void request(const std::shared_ptr<HandshakeOp>& op) {
+                std::lock_guard<std::mutex> request_lock(request_mtx_);
+                std::vector<ThreadState*> claimed;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    {
+                        std::lock_guard<std::mutex> op_lock(op->mtx);
+                        op->remaining = threads_.size();
+                    }
+                    for (ThreadState* t : threads_) {
+                        t->post(op);
+                    }
+                    for (ThreadState* t : threads_) {
+                        if (t != thread_state && t->claim()) {
+                            claimed.push_back(t);
+                        }
+                    }
+                }
+                // A claimed thread cannot leave its scope, let alone detach.
+                for (ThreadState* t : claimed) {
+                    t->run_ops();
+                    t->mode_.store(ThreadState::kBlocked, std::memory_order_release);
+                }
+                poll();
+            }
+
+            static void poll() {
+                ThreadState* self = thread_state;
+                if (!self || self->running_ops_ || !self->armed_.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                self->running_ops_ = true;
+                self->run_ops();
+                self->running_ops_ = false;
+            }
+
+        private:
+            std::mutex request_mtx_;
+            std::mutex mtx_;
+            std::vector<ThreadState*> threads_;
+        };
+
+        struct ThreadAccess {
+            // Publishes kBlocked, then looks for work posted meanwhile: either
+            // the requester saw kBlocked and claims the thread, or the thread
+            // sees the work and runs it before blocking.
+            static void enter_blocking(ThreadState& s) {
+                if (s.blocking_depth_++ > 0) {
+                    return;
+                }
+                ThreadRegistry::poll();
+                for (;;) {
+                    s.mode_.store(ThreadState::kBlocked, std::memory_order_seq_cst);
+                    if (!s.armed_.load(std::memory_order_seq_cst)) {
+                        return;
+                    }
+                    int blocked = ThreadState::kBlocked;
+                    if (!s.mode_.compare_exchange_strong(blocked, ThreadState::kRunning, std::memory_order_acquire)) {
+                        return;   // claimed: the requester runs it
+                    }
+                    ThreadRegistry::poll();
+                }
+            }
+
+            static void leave_blocking(ThreadState& s) {
+                if (--s.blocking_depth_ > 0) {
+                    return;
+                }
+                for (;;) {
+                    int blocked = ThreadState::kBlocked;
+                    if (s.mode_.compare_exchange_weak(blocked, ThreadState::kRunning, std::memory_order_acquire)) {
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+                ThreadRegistry::poll();
+            }
+        };
+    }
+
+    // Registers the calling thread for handshakes for the lifetime of the
+    // object (nests). An attached thread must reach a safepoint regularly:
+    // New, allocate, NewArray, NewBatch, Arena::New, PoolAllocator,
+    // gc_rc_malloc and gc_malloc_bulk poll on entry, and safepoint() polls explicitly. Threads that are not
+    // attached are never waited for.
+    class ThreadAttach {
+    public:
+        ThreadAttach() {
+            detail::ThreadRegistry::instance().attach();
+        }
+
+        ~ThreadAttach() {
+            detail::ThreadRegistry::instance().detach();
+        }
+
+        ThreadAttach(const ThreadAttach&) = delete;
+        ThreadAttach& operator=(const ThreadAttach&) = delete;
+    };
+
+    // Wraps a blocking call (I/O, a lock, a condition variable) of an
+    // attached thread: handshakes posted meanwhile are run by the thread
+    // that requests them instead of waiting for this one. The thread must
+    // not touch GC::Ptrs, Roots or count buffers inside the scope.
+    class BlockingScope {
+    public:
+        BlockingScope() : state_(detail::thread_state) {
+            if (state_) {
+                detail::ThreadAccess::enter_blocking(*state_);
+            }
+        }
+
+        ~BlockingScope() {
+            if (state_) {
+                detail::ThreadAccess::leave_blocking(*state_);
+            }
+        }
+
+        BlockingScope(const BlockingScope&) = delete;
+        BlockingScope& operator=(const BlockingScope&) = delete;
+
+    private:
+        ThreadState* state_;
+    };
+
+    // Runs the handshake actions posted to this thread, if any. Cheap
+    // enough for inner loops: one relaxed load while nothing is pending.
+    inline void safepoint() {
+        detail::safepoint_poll();
+    }
+
+    inline bool thread_attached() noexcept {
+        return detail::thread_state != nullptr;
+    }
+
+    inline size_t attached_threads() {
+        return detail::ThreadRegistry::instance().size();
+    }
+
+    // Pending handshake. Copies share the request.
+    class Handshake {
+    public:
+        explicit Handshake(std::shared_ptr<detail::HandshakeOp> op) : op_(std::move(op)) {}
+
+        // Every thread has run the action (or detached).
+        bool done() const {
+            std::lock_guard<std::mutex> lock(op_->mtx);
+            return op_->remaining == 0;
+        }
+
+        // Blocks until done(); an attached caller waits inside a
+        // BlockingScope, so handshakes it owes are run for it.
+        void wait() const {
+            BlockingScope blocking;
+            std::unique_lock<std::mutex> lock(op_->mtx);
+            op_->cv.wait(lock, [&] { return op_->remaining == 0; });
+        }
+
+        template<typename Rep, typename Period>
+        bool wait_for(std::chrono::duration<Rep, Period> timeout) const {
+            BlockingScope blocking;
+            std::unique_lock<std::mutex> lock(op_->mtx);
+            return op_->cv.wait_for(lock, timeout, [&] { return op_->remaining == 0; });
+        }
+
+    private:
+        std::shared_ptr<detail::HandshakeOp> op_;
+    };
+
+    // Asks every attached thread to run `action` once, without stopping
+    // the others: each runs it at its next safepoint, which may be the
+    // start of any allocation listed at ThreadAttach. A thread that neither
+    // allocates nor calls safepoint() holds the handshake up indefinitely
+    // unless it is inside a BlockingScope. Threads inside one, and the
+    // caller, have it run before handshake() returns. `action` runs on top
+    // of whatever the thread was doing and may allocate, but must not
+    // request handshakes or attach threads.
+    //
+    //   GC::handshake([](GC::ThreadState& t) { t.flush_counts(); }).wait();
+    inline Handshake handshake(std::function<void(ThreadState&)> action) {
+        auto op = std::make_shared<detail::HandshakeOp>();
+        op->action = std::move(action);
+        op->start = detail::stats_state().enabled.load(std::memory_order_relaxed) ? detail::now_ns() : 0;
+        detail::ThreadRegistry::instance().request(op);
+        return Handshake(std::move(op));
+    }
+
+}
@@ -0,0 +1,344 @@
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace GC {
+
+    // What the collector measures. Times are in nanoseconds.
+    enum class Metric {
+        DestructionTime,     // wall time of one top-level release_strong cascade
+        DestructionObjects,  // objects destroyed by that cascade
+        CycleScanTime,       // one pass over the object graph looking for cycles
+        CHeapCollectTime,    // one batched C heap pass (gc_trim, gc_free_bulk)
+        HeapCollectTime,     // one paced or pressure-driven collection
+        HandshakeTime,       // from a handshake request until every thread has run it
+        Count_
+    };
+
+    inline const char* metric_name(Metric m) noexcept {
+        switch (m) {
+        case Metric::DestructionTime:    return "destruction_time_ns";
+        case Metric::DestructionObjects: return "destruction_objects";
+        case Metric::CycleScanTime:      return "cycle_scan_time_ns";
+        case Metric::CHeapCollectTime:   return "c_heap_collect_time_ns";
+        case Metric::HeapCollectTime:    return "heap_collect_time_ns";
+        case Metric::HandshakeTime:      return "handshake_time_ns";
+        default:                         return "unknown";
+        }
+    }
+
+    struct HistogramSnapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t min = 0;
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets;
+
+        double mean() const noexcept {
+            return count ? static_cast<double>(sum) / static_cast<double>(count) : 0.0;
+        }
+
+        // Upper bound of the bucket holding the p-th percentile (0..100).
+        uint64_t percentile(double p) const noexcept;
+    };
+
+    // Log-linear histogram in the style of HdrHistogram: every power of two
+    // is split into 16 linear sub-buckets, so any recorded value is reported
+    // with at most 6.25% relative error. Recording is a few relaxed atomics.
+    class Histogram {
+    public:
+        static constexpr unsigned kSubBits = 4;
+        static constexpr unsigned kSub = 1u << kSubBits;
+        static constexpr unsigned kBuckets = (64 - kSubBits + 1) * kSub;
+
+        Histogram() noexcept { reset(); }
+
+        Histogram(const Histogram&) = delete;
+        Histogram& operator=(const Histogram&) = delete;
+
+        static unsigned bucket_of(uint64_t v) noexcept {
+            if (v < kSub) {
+                return static_cast<unsigned>(v);
+            }
+            unsigned shift = msb(v) - kSubBits;
+            return (shift + 1) * kSub + static_cast<unsigned>((v >> shift) & (kSub - 1));
+        }
+
+        static uint64_t bucket_upper(unsigned i) noexcept {
+            if (i < kSub) {
+                return i;
+            }
+            unsigned shift = i / kSub - 1;
+            uint64_t lower = static_cast<uint64_t>(kSub + i % kSub) << shift;
+            return lower + ((uint64_t(1) << shift) - 1);
+        }
+
+        void record(uint64_t v) noexcept {
+            buckets_[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(v, std::memory_order_relaxed);
+
+            uint64_t cur = min_.load(std::memory_order_relaxed);
+            while (v < cur && !min_.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+            }
+            cur = max_.load(std::memory_order_relaxed);
+            while (v > cur && !max_.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+            }
+        }
+
+        HistogramSnapshot snapshot() const {
+            HistogramSnapshot s;
+            s.buckets.resize(kBuckets);
+            for (unsigned i = 0; i < kBuckets; ++i) {
+                s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+            }
+            s.count = count_.load(std::memory_order_relaxed);
+            s.sum = sum_.load(std::memory_order_relaxed);
+            s.min = s.count ? min_.load(std::memory_order_relaxed) : 0;
+            s.max = max_.load(std::memory_order_relaxed);
+            return s;
+        }
+
+        void reset() noexcept {
+            for (auto& b : buckets_) {
+                b.store(0, std::memory_order_relaxed);
+            }
+            count_.store(0, std::memory_order_relaxed);
+            sum_.store(0, std::memory_order_relaxed);
+            min_.store(UINT64_MAX, std::memory_order_relaxed);
+            max_.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        static unsigned msb(uint64_t v) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+            return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#elif defined(_MSC_VER) && defined(_WIN64)
+            unsigned long idx;
+            _BitScanReverse64(&idx, v);
+            return static_cast<unsigned>(idx);
+#else
+            unsigned r = 0;
+            while (v >>= 1) ++r;
+            return r;
+#endif
+        }
+
+        std::atomic<uint64_t> buckets_[kBuckets];
+        std::atomic<uint64_t> count_;
+        std::atomic<uint64_t> sum_;
+        std::atomic<uint64_t> min_;
+        std::atomic<uint64_t> max_;
+    };
+
+    inline uint64_t HistogramSnapshot::percentile(double p) const noexcept {
+        if (count == 0) {
+            return 0;
+        }
+        double rank = p / 100.0 * static_cast<double>(count);
+        uint64_t target = rank < 1.0 ? 1 : static_cast<uint64_t>(rank + 0.999999);
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen >= target) {
+                uint64_t upper = Histogram::bucket_upper(i);
+                return upper < max ? upper : max;
+            }
+        }
+        return max;
+    }
+
+    namespace detail {
+
+        struct StatsState {
+            std::atomic<bool> enabled{ false };
+            Histogram histograms[static_cast<size_t>(Metric::Count_)];
+        };
+
+        inline StatsState& stats_state() noexcept {
+            static StatsState state;
+            return state;
+        }
+
+        inline uint64_t now_ns() noexcept {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        // Per-thread bookkeeping for the destruction cascade in progress.
+        struct CascadeState {
+            unsigned depth = 0;
+            uint64_t objects = 0;
+            uint64_t start = 0;
+        };
+
+        inline thread_local CascadeState cascade_state;
+
+        // Wraps one release_strong that reached zero. Only the outermost scope
+        // on a thread records; nested releases triggered by destructors are
+        // counted into it.
+        class CascadeScope {
+        public:
+            CascadeScope() noexcept
+                : armed_(stats_state().enabled.load(std::memory_order_relaxed)) {
+                if (armed_ && cascade_state.depth++ == 0) {
+                    cascade_state.objects = 0;
+                    cascade_state.start = now_ns();
+                }
+            }
+
+            ~CascadeScope() {
+                if (armed_ && --cascade_state.depth == 0) {
+                    StatsState& s = stats_state();
+                    s.histograms[static_cast<size_t>(Metric::DestructionTime)]
+                        .record(now_ns() - cascade_state.start);
+                    s.histograms[static_cast<size_t>(Metric::DestructionObjects)]
+                        .record(cascade_state.objects);
+                }
+            }
+
+            CascadeScope(const CascadeScope&) = delete;
+            CascadeScope& operator=(const CascadeScope&) = delete;
+
+        private:
+            bool armed_;
+        };
+
+        inline void cascade_count_object() noexcept {
+            if (cascade_state.depth) {
+                ++cascade_state.objects;
+            }
+        }
+
+        // Times a whole collector pass into the given metric.
+        class PassTimer {
+        public:
+            explicit PassTimer(Metric m) noexcept
+                : metric_(m), start_(stats_state().enabled.load(std::memory_order_relaxed) ? now_ns() : 0) {
+            }
+
+            ~PassTimer() {
+                if (start_) {
+                    stats_state().histograms[static_cast<size_t>(metric_)].record(now_ns() - start_);
+                }
+            }
+
+            PassTimer(const PassTimer&) = delete;
+            PassTimer& operator=(const PassTimer&) = delete;
+
+        private:
+            Metric metric_;
+            uint64_t start_;
+        };
+
+        class StatsExporter {
+        public:
+            ~StatsExporter() { stop(); }
+
+            void start(const std::string& path, std::chrono::milliseconds interval);
+            void stop();
+
+        private:
+            std::mutex mtx_;
+            std::condition_variable cv_;
+            std::thread worker_;
+            bool stopping_ = false;
+        };
+    }
+
+    inline void enable_stats(bool enabled = true) noexcept {
+        detail::stats_state().enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    inline bool stats_enabled() noexcept {
+        return detail::stats_state().enabled.load(std::memory_order_relaxed);
+    }
+
+    inline HistogramSnapshot stats(Metric m) {
+        return detail::stats_state().histograms[static_cast<size_t>(m)].snapshot();
+    }
+
+    inline void reset_stats() noexcept {
+        for (auto& h : detail::stats_state().histograms) {
+            h.reset();
+        }
+    }
+
+    // One line per metric: count, mean, p50/p90/p99/p99.9 and max.
+    inline void dump_stats(std::ostream& os) {
+        for (size_t i = 0; i < static_cast<size_t>(Metric::Count_); ++i) {
+            Metric m = static_cast<Metric>(i);
+            HistogramSnapshot s = stats(m);
+            os << metric_name(m)
+                << " count=" << s.count
+                << " mean=" << static_cast<uint64_t>(s.mean())
+                << " p50=" << s.percentile(50)
+                << " p90=" << s.percentile(90)
+                << " p99=" << s.percentile(99)
+                << " p99.9=" << s.percentile(99.9)
+                << " max=" << s.max << "\n";
+        }
+    }
+
+    namespace detail {
+
+        inline void StatsExporter::start(const std::string& path, std::chrono::milliseconds interval) {
+            stop();
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopping_ = false;
+            worker_ = std::thread([this, path, interval] {
+                std::unique_lock<std::mutex> guard(mtx_);
+                while (!cv_.wait_for(guard, interval, [this] { return stopping_; })) {
+                    std::ofstream out(path, std::ios::app);
+                    if (!out) {
+                        continue;
+                    }
+                    out << "# " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
+                    dump_stats(out);
+                }
+            });
+        }
+
+        inline void StatsExporter::stop() {
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                stopping_ = true;
+            }
+            cv_.notify_all();
+            if (worker_.joinable()) {
+                worker_.join();
+            }
+        }
+
+        inline StatsExporter& stats_exporter() {
+            static StatsExporter exporter;
+            return exporter;
+        }
+    }
+
+    // Appends a dump_stats() snapshot to `path` every `interval` until
+    // stop_stats_export() or program exit.
+    inline void export_stats(const std::string& path, std::chrono::milliseconds interval) {
+        detail::stats_exporter().start(path, interval);
+    }
+
+    inline void stop_stats_export() {
+        detail::stats_exporter().stop();
+    }
+
+}
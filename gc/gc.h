@@ -1,11 +1,23 @@
 #pragma once
 
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
 #ifdef __cplusplus
    #include "../gc/cpp/Cpp_Ptr.hpp"
+   #include "../gc/cpp/Cpp_Arena.hpp"
+   #include "../gc/cpp/Cpp_Epoch.hpp"
+   #include "../gc/cpp/Cpp_Hazard.hpp"
+   #include "../gc/cpp/Cpp_Concurrent.hpp"
+   #include "../gc/cpp/Cpp_Root.hpp"
+   #include "../gc/cpp/Cpp_Safepoint.hpp"
+   #include "../gc/cpp/Cpp_Handle.hpp"
 extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 
     // C-visible minimal struct (C++ expands it internally)
@@ -17,11 +29,130 @@ extern "C" {
     PtrBase gc_local_malloc(size_t size);
     PtrBase gc_local_calloc(size_t count, size_t size);
 
+    // Bulk allocation: `count` chunks of `size` bytes from one slab, written
+    // to out_ptrs. Returns the number of chunks (0 on failure). The slab is
+    // released as a whole with gc_free_bulk(out_ptrs[0]). The slab counts
+    // in gc_heap_usage() and towards the heap limit while it exists.
+    size_t gc_malloc_bulk(size_t size, size_t count, void** out_ptrs);
+    void gc_free_bulk(void* first);
+
+    // Returns empty GC heap pages and free malloc memory to the OS now.
+    // Returns the bytes released from the GC heap.
+    size_t gc_trim(void);
+
+    // Bytes the GC heap holds from the OS (GC::heap_usage()).
+    size_t gc_heap_usage(void);
+
+    // Milliseconds a heap page stays empty before its memory goes back to
+    // the OS; negative keeps it.
+    void gc_set_heap_decay(long long milliseconds);
+
+    // Handles: 64-bit names for GC-managed objects that C and C++ share
+    // (GC::make_handle / GC::handle_ptr on the C++ side). Lookups are O(1)
+    // and lock-free; a freed handle never names another object later.
+    typedef uint64_t gc_handle_t;
+    #define GC_NULL_HANDLE ((gc_handle_t)0)
+
+    typedef enum gc_handle_kind {
+        GC_HANDLE_STRONG = 0,   // keeps the object alive
+        GC_HANDLE_WEAK = 1      // does not; reads as NULL once it is gone
+    } gc_handle_kind;
+
+    // New zeroed block of `size` bytes owned by a strong handle.
+    gc_handle_t gc_handle_alloc(size_t size);
+
+    // Another handle on the same object; GC_NULL_HANDLE if `h` is stale or
+    // its object is gone.
+    gc_handle_t gc_handle_dup(gc_handle_t h, gc_handle_kind kind);
+
+    // Drops the handle's reference. Returns 0 for stale handles.
+    int gc_handle_free(gc_handle_t h);
+
+    // The object, or NULL if the handle is stale or (weak) the object is
+    // gone. Valid while some strong handle or pin keeps the object alive.
+    void* gc_handle_get(gc_handle_t h);
+
+    // Keeps the object alive and at the returned address until the matching
+    // gc_handle_unpin, even if the handle is freed meanwhile. NULL if the
+    // object is gone. Pins nest. Unpinning a handle that has no pin left,
+    // or whose slot has been reused, does nothing.
+    void* gc_handle_pin(gc_handle_t h);
+    void gc_handle_unpin(gc_handle_t h);
+
+    int gc_handle_is_weak(gc_handle_t h);
+
+    // Reference-counted blocks. Each one starts with this header, right
+    // before the pointer the allocator returns; the count starts at 1 and
+    // the block goes back to its GC heap size class when gc_release takes
+    // it to 0. Define GC_C_REFCOUNT to make gc_malloc / gc_calloc /
+    // gc_new / gc_new_array allocate these.
+    typedef struct gc_rc_header {
+        int32_t count;          // references
+        uint32_t size_class;    // GC heap size class, or GC_RC_LARGE
+        uint64_t size;          // bytes requested
+    } gc_rc_header;
+    #define GC_RC_LARGE 0xFFFFFFFFu
+
+    void* gc_rc_malloc(size_t size);
+    void* gc_rc_calloc(size_t count, size_t size);
+
+    // Returns the block to the heap; called by gc_release at count 0.
+    void gc_rc_free(void* p);
+
+#if defined(_MSC_VER) && !defined(__clang__)
+    #define GC_RC_INCREMENT(count) _InterlockedIncrement((volatile long*)(count))
+    #define GC_RC_DECREMENT(count) _InterlockedDecrement((volatile long*)(count))
+    #define GC_RC_LOAD(count) (*(const volatile long*)(count))
+#else
+    #define GC_RC_INCREMENT(count) __atomic_add_fetch((count), 1, __ATOMIC_RELAXED)
+    #define GC_RC_DECREMENT(count) __atomic_sub_fetch((count), 1, __ATOMIC_ACQ_REL)
+    #define GC_RC_LOAD(count) __atomic_load_n((count), __ATOMIC_RELAXED)
+#endif
+
+    // Adds a reference to a gc_rc_* block (NULL is ignored); returns `p`.
+    static inline void* gc_retain(void* p) {
+        if (p) {
+            GC_RC_INCREMENT(&((gc_rc_header*)p - 1)->count);
+        }
+        return p;
+    }
+
+    // Drops a reference; the last one frees the block.
+    static inline void gc_release(void* p) {
+        if (p && GC_RC_DECREMENT(&((gc_rc_header*)p - 1)->count) == 0) {
+            gc_rc_free(p);
+        }
+    }
+
+    static inline int32_t gc_ref_count(const void* p) {
+        return p ? (int32_t)GC_RC_LOAD(&((const gc_rc_header*)p - 1)->count) : 0;
+    }
+
     // ----------------------------------------------
     // High-Level Typed API for C (NO casts)
     // ----------------------------------------------
 #define Ptr(T) T*
 
+#ifdef GC_C_REFCOUNT
+
+// Allocate one object of type T (count 1, zeroed)
+#define gc_new(T) \
+    ((T*)gc_rc_calloc(1, sizeof(T)))
+
+// Allocate array (typed, count 1, zeroed)
+#define gc_new_array(T, count) \
+    ((T*)gc_rc_calloc((count), sizeof(T)))
+
+// malloc-style, count 1
+#define gc_malloc(size) \
+    (gc_rc_malloc(size))
+
+// calloc-style, count 1
+#define gc_calloc(count, size) \
+    (gc_rc_calloc((count), (size)))
+
+#else
+
 // Allocate one object of type T
 #define gc_new(T) \
     ((T*)gc_local_malloc(sizeof(T)).raw)
@@ -38,6 +169,8 @@ extern "C" {
 #define gc_calloc(count, size) \
     (gc_local_calloc((count), (size)).raw)
 
+#endif
+
 
 #ifdef __cplusplus
 }
@@ -2,12 +2,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-typedef struct {
+typedef struct Node {
     int x;
     float y;
     struct Node* next;
 } Node;
 
+static int failures = 0;
+
+// Behaviour checks print what failed; main returns non-zero if any did.
+static void check(int ok, const char* what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static int all_zero(const unsigned char* p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 int main() {
 
     Node* n1 = gc_malloc(sizeof(Node));
@@ -30,4 +49,126 @@ int main() {
     printf("  n1->next = %p (should be NULL)\n", (void*)n1->next);
     printf("  n2->next = %p (should be NULL)\n", (void*)n2->next);
 
-} 
+    gc_release(n1);
+    gc_release(n2);
+
+    // gc_rc_calloc on both sides of the size-class boundary: the header
+    // takes 16 bytes, so 496 is the largest request served from a page
+    {
+        const size_t sizes[] = { 0, 1, 496, 497, 1 << 20 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            size_t size = sizes[i];
+            unsigned char* p = gc_rc_calloc(1, size);
+            check(p != NULL, "rc_calloc: allocates");
+            if (!p) {
+                continue;
+            }
+            const gc_rc_header* header = (const gc_rc_header*)p - 1;
+            check(((uintptr_t)p % sizeof(gc_rc_header)) == 0, "rc_calloc: block stays aligned");
+            check(header->size == size, "rc_calloc: records the size");
+            check(gc_ref_count(p) == 1, "rc_calloc: count starts at 1");
+            check(all_zero(p, size), "rc_calloc: zeroed");
+            if (size <= 496) {
+                check(header->size_class != GC_RC_LARGE
+                    && (header->size_class + 1) * 16 >= sizeof(gc_rc_header) + size,
+                    "rc_calloc: small sizes come from a size class that fits");
+            }
+            else {
+                check(header->size_class == GC_RC_LARGE, "rc_calloc: larger sizes bypass the pages");
+            }
+            gc_retain(p);
+            gc_release(p);
+            check(gc_ref_count(p) == 1, "rc_calloc: retain/release pair");
+            gc_release(p);
+        }
+        check(gc_rc_calloc((size_t)-1 / 2, 4) == NULL, "rc_calloc: count * size overflow gives NULL");
+    }
+
+    // Bulk slabs: aligned, distinct chunks, counted in gc_heap_usage()
+    // until freed
+    {
+        void* chunks[8];
+        size_t before = gc_heap_usage();
+        check(gc_malloc_bulk(24, 8, chunks) == 8, "bulk: allocates every chunk");
+        size_t grown = gc_heap_usage() - before;
+        check(grown >= 8 * 24, "bulk: slab counted in heap usage");
+        int aligned = 1;
+        for (int i = 0; i < 8; ++i) {
+            aligned = aligned && (uintptr_t)chunks[i] % sizeof(gc_rc_header) == 0;
+            if (i > 0) {
+                aligned = aligned && (char*)chunks[i] - (char*)chunks[i - 1] >= 24;
+            }
+        }
+        check(aligned, "bulk: chunks aligned and apart");
+        gc_free_bulk(chunks[0]);
+        check(gc_heap_usage() == before, "bulk: slab uncounted when freed");
+        check(gc_malloc_bulk(16, (size_t)-1 / 8, chunks) == 0, "bulk: size overflow gives 0");
+    }
+
+    // Handles: strong and weak lookups, pins outliving the last handle,
+    // stale handles
+    {
+        gc_handle_t h = gc_handle_alloc(64);
+        check(h != GC_NULL_HANDLE, "handle: alloc");
+        unsigned char* p = gc_handle_get(h);
+        check(p != NULL && all_zero(p, 64), "handle: get returns the zeroed block");
+
+        gc_handle_t weak = gc_handle_dup(h, GC_HANDLE_WEAK);
+        gc_handle_t strong = gc_handle_dup(h, GC_HANDLE_STRONG);
+        check(gc_handle_is_weak(weak) && !gc_handle_is_weak(strong), "handle: dup kinds");
+        check(gc_handle_get(weak) == p && gc_handle_get(strong) == p, "handle: dups name the same object");
+
+        check(gc_handle_free(h) == 1, "handle: free");
+        check(gc_handle_get(h) == NULL, "handle: freed handle reads as NULL");
+        check(gc_handle_free(h) == 0, "handle: second free is refused");
+        check(gc_handle_get(weak) == p, "handle: weak sees the object while a strong handle remains");
+
+        void* pinned = gc_handle_pin(strong);
+        check(pinned == p, "handle: pin returns the object");
+        check(gc_handle_free(strong) == 1, "handle: free while pinned");
+        check(gc_handle_get(weak) == p, "handle: pin keeps the object alive");
+        gc_handle_unpin(strong);
+        check(gc_handle_get(weak) == NULL, "handle: weak reads as NULL once the object is gone");
+        check(gc_handle_dup(weak, GC_HANDLE_STRONG) == GC_NULL_HANDLE, "handle: no strong dup of a dead object");
+        check(gc_handle_free(weak) == 1, "handle: free weak");
+        check(gc_handle_get(GC_NULL_HANDLE) == NULL, "handle: null handle");
+    }
+
+    // Unpinning a handle that holds no pin, or one whose slot has been
+    // reused, must leave every count alone
+    {
+        gc_handle_t h = gc_handle_alloc(32);
+        gc_handle_t weak = gc_handle_dup(h, GC_HANDLE_WEAK);
+        void* p = gc_handle_get(h);
+        gc_handle_unpin(h);
+        gc_handle_unpin(h);
+        check(gc_handle_get(h) == p && gc_handle_get(weak) == p, "unpin: without a pin keeps the object");
+
+        check(gc_handle_pin(h) == p, "unpin: pin");
+        gc_handle_unpin(h);
+        gc_handle_unpin(h);
+        check(gc_handle_get(weak) == p, "unpin: a second unpin keeps the object");
+        check(gc_handle_free(h) == 1, "unpin: handle still frees");
+        check(gc_handle_get(weak) == NULL, "unpin: the handle held the last reference");
+
+        // The freed slot goes back on the free list, so the next handle
+        // usually takes it with a new generation.
+        gc_handle_t next = gc_handle_alloc(32);
+        gc_handle_t next_weak = gc_handle_dup(next, GC_HANDLE_WEAK);
+        void* q = gc_handle_get(next);
+        gc_handle_unpin(h);
+        check(gc_handle_get(next) == q && gc_handle_get(next_weak) == q, "unpin: after free leaves the new handle alone");
+        check(gc_handle_pin(next) == q, "unpin: pin the new handle");
+        check(gc_handle_free(next) == 1, "unpin: free the pinned handle");
+        gc_handle_unpin(h);
+        check(gc_handle_get(next_weak) == q, "unpin: a stale handle does not release another handle's pin");
+        gc_handle_unpin(next);
+        check(gc_handle_get(next_weak) == NULL, "unpin: the pin held the last reference");
+        gc_handle_unpin(next);
+        gc_handle_free(weak);
+        gc_handle_free(next_weak);
+    }
+
+    printf(failures == 0 ? "All checks passed\n" : "Some checks failed\n");
+    return failures == 0 ? 0 : 1;
+}